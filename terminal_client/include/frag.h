@@ -0,0 +1,90 @@
+#ifndef FRAG_INCLUDED
+#define FRAG_INCLUDED 1
+
+#include <stdbool.h>
+#include <gamestate.h>
+#include <vec.h>
+#include <tengi.h>
+
+// Maps pixel coordinates to screen space: uv = coords*uv_scale + uv_offset
+typedef struct viewport
+{
+    Vec2 uv_scale;
+    Vec2 uv_offset;
+    bool mirrored; // looking from +z, PLAYER2 or right side of split screen
+} Viewport;
+
+// Objects besides the walls, as bits of Uniforms.objects
+enum
+{
+    OBJECT_BALL    = 1 << 0,
+    OBJECT_PLAYER1 = 1 << 1,
+    OBJECT_PLAYER2 = 1 << 2,
+    OBJECTS_ALL    = OBJECT_BALL | OBJECT_PLAYER1 | OBJECT_PLAYER2,
+};
+
+// Read-only inputs of main_image(). Built once per frame by uniforms_init(),
+// so shading threads never touch the shared gamestate.
+typedef struct uniforms
+{
+    Vec3     ball;
+    Vec3     player1;
+    Vec3     player2;
+    int      player;
+    Renderer renderer;
+    Quality  quality; // only used by CPU frames outside of frag.c
+    Scalar   time;
+    Vec2     resolution;
+    int      objects; // that rays can hit, OBJECTS_ALL unless culled
+
+    Vec3     camera; // ray origin when not mirrored
+    Scalar   camera_distance_from_screen;
+
+    Scalar   split_x; // first pixel column of viewports[1]
+    Viewport viewports[2];
+} Uniforms;
+
+void uniforms_init(
+    Uniforms*          uniforms,
+    const t_gamestate* gamestate,
+    Vec2               resolution,
+    Scalar             char_height,
+    Scalar             time);
+
+// Gamma corrected and quantized frag_color
+RGBA8 output_color(Vec3 frag_color);
+
+// Coordinates are in pixels, origin at top left.
+RGBA8 main_image(Vec2 coords, const Uniforms* uniforms);
+
+// Where the camera ray of a pixel hits the walls. Only depends on the camera
+// and resolution, so it can be reused until they change.
+typedef struct court_sample
+{
+    Vec3 position;
+    Vec3 normal;
+    bool hit;
+} CourtSample;
+
+#define DYNAMIC_RECTS_MAX 6 // ball and paddles in both viewports
+
+CourtSample court_sample(Vec2 coords, const Uniforms* uniforms);
+
+// Same as main_image() for pixels outside of dynamic_rects().
+RGBA8 court_image(CourtSample sample, Vec2 coords, const Uniforms* uniforms);
+
+// Returns the number of rects written. Rays of pixels outside of them can only
+// hit the walls, and inside of them, only the walls and objects[i]. Pixels can
+// be rendered with Uniforms.objects set to the objects of rects they are in.
+int dynamic_rects(
+    IRect           rects[VEC_STATIC DYNAMIC_RECTS_MAX],
+    int             objects[VEC_STATIC DYNAMIC_RECTS_MAX],
+    const Uniforms* uniforms);
+
+#if VEC_PACKETS
+// Ray marches VEC_PACKET_WIDTH pixels starting from coords towards +x.
+void main_image_packet(
+    RGBA8 out[VEC_STATIC VEC_PACKET_WIDTH], Vec2 coords, const Uniforms* uniforms);
+#endif
+
+#endif // FRAG_INCLUDED
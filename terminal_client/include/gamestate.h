@@ -15,6 +15,7 @@ extern "C" {
 #define PLAYER2			2
 #define SPLIT_SCREEN	3
 
+#define MENU_GAME_ROOT_LENGTH          27
 #define MENU_SELECT_ACCELERATOR_LENGTH 40
 
 typedef enum menu_state
@@ -23,6 +24,60 @@ typedef enum menu_state
     MENU_SELECT_ACCELERATOR,
 } MenuState;
 
+// Rows of MENU_GAME_ROOT in order
+typedef enum menu_root_item
+{
+    MENU_ROOT_SELECT_ACCELERATOR,
+    MENU_ROOT_RENDERER,
+    MENU_ROOT_QUALITY,
+    MENU_ROOT_COLORS,
+    MENU_ROOT_GLYPHS,
+    MENU_ROOT_EXIT,
+    MENU_ROOT_LENGTH,
+} MenuRootItem;
+
+typedef enum renderer
+{
+    RENDERER_RAY_MARCHING,         // sphere tracing SDFs
+    RENDERER_RAY_MARCHING_PACKETS, // same, but SIMD lanes march together
+    RENDERER_RAY_TRACING,          // analytic intersections
+    RENDERER_LENGTH,
+} Renderer;
+
+typedef enum quality
+{
+    QUALITY_FULL,         // every damaged pixel is shaded
+    QUALITY_CHECKERBOARD, // half of the court is shaded, the rest reused
+    QUALITY_LENGTH,
+} Quality;
+
+// Colors written to the terminal, see tengi_set_output_colors()
+typedef enum colors
+{
+    COLORS_ADAPTIVE,     // 24-bit until the terminal falls behind
+    COLORS_24BIT,
+    COLORS_256,
+    COLORS_256_DITHERED,
+    COLORS_16,
+    COLORS_16_DITHERED,
+    COLORS_LENGTH,
+} Colors;
+
+// Glyphs that split terminal cells to pixels, see tengi_set_cell_glyphs()
+typedef enum glyphs
+{
+    GLYPHS_QUADRANTS, // 2x2, every font has them
+    GLYPHS_SEXTANTS,  // 2x3, needs a font with Unicode 13 sextants
+    GLYPHS_BRAILLE,   // 2x4
+    GLYPHS_LENGTH,
+} Glyphs;
+
+typedef struct frame_stats
+{
+    uint64_t frames;
+    uint64_t missed_deadlines; // frames drawn after they should have been
+} FrameStats;
+
 typedef struct s_ball
 {
 	double	x;
@@ -40,14 +95,22 @@ typedef struct s_gamestate
 {
 	// Mutex etc.
 	pthread_mutex_t	lock; // Always use this mutex when both threads running
+    pthread_cond_t  changed; // see gamestate_changed()
+    uint64_t        changes;
 	bool			game_running;
 	bool			exit_thread;
     uint64_t        resize_timer;
 
     MenuState menu_state;
     size_t    selected_accelerator;
+    Renderer  renderer;
+    Quality   quality;
+    Colors    colors;
+    Glyphs    glyphs;
     int       hovered;
 
+    FrameStats frame_stats; // totals since start, written by rendering_loop()
+
 	// The actual gamestate stuff
 	t_ball		ball;
 	t_player	player1;
@@ -71,6 +134,16 @@ typedef struct s_move_paddle
 	double	y;
 } t_move_paddle;
 
+// Wakes up rendering_loop(), which sleeps while nothing it draws changes. Call
+// after changing gamestate without holding lock.
+static inline void gamestate_changed(t_gamestate* gamestate)
+{
+    pthread_mutex_lock(&gamestate->lock);
+    gamestate->changes++;
+    pthread_cond_signal(&gamestate->changed);
+    pthread_mutex_unlock(&gamestate->lock);
+}
+
 void clipong_set_input_event_hooks(Events* data);
 extern int           g_select_menu_interrupt  ;
 
@@ -0,0 +1,26 @@
+#ifndef TILE_POOL_INCLUDED
+#define TILE_POOL_INCLUDED 1
+
+#include <stdbool.h>
+
+// Persistent threads running tasks of a frame. Each thread gets a share of the
+// tasks, and when it runs out, it steals from the others.
+typedef struct tile_pool TilePool;
+
+// threads <= 0 uses all online cores. pin_threads binds each thread to a core.
+// The calling thread is one of the threads. NULL on failure.
+TilePool* tile_pool_create(int threads, bool pin_threads);
+void      tile_pool_destroy(TilePool* pool);
+
+// Runs task(tile, param) for tiles in order and returns when all are done.
+// Earlier tiles in order are started first. If seconds is not NULL, the time
+// each tile took is written to seconds[tile]. Not thread safe.
+void tile_pool_run(
+    TilePool*   pool,
+    const int   order[],
+    int         length,
+    void      (*task)(int tile, void* param),
+    void*       param,
+    float       seconds[]);
+
+#endif // TILE_POOL_INCLUDED
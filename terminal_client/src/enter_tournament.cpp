@@ -132,6 +132,7 @@ void in_game()
     g_events.keys_released[7] = (char*)1;
 
 	g_gamestate.game_running = true;
+	gamestate_changed(&g_gamestate);
 	tengi_handle_events();
     tengi_grab_keyboard();
 	enable_mouse_tracking_and_tcsetattr();
@@ -144,6 +145,7 @@ void in_game()
 	}
 	g_events.exiting_game = false;
 	g_gamestate.game_running = false;
+	gamestate_changed(&g_gamestate);
 	usleep(1000);
 	disable_mouse_tracking_and_tcsetattr();
 	tengi_handle_events();
@@ -1,11 +1,12 @@
-#include <gamestate.h>
-#include <vec.h>
+#include <frag.h>
 
-static t_gamestate GAMESTATE;
-#define u_ball    vec3(GAMESTATE.ball.x, GAMESTATE.ball.y, GAMESTATE.ball.z)
-#define u_player1 vec3(GAMESTATE.player1.x, GAMESTATE.player1.y, -court_length)
-#define u_player2 vec3(GAMESTATE.player2.x, GAMESTATE.player2.y, +court_length)
-#define u_player  GAMESTATE.player
+// Functions using these take `const Uniforms* u` as last parameter.
+#define u_ball     (u->ball)
+#define u_player1  (u->player1)
+#define u_player2  (u->player2)
+#define u_time     (u->time)
+#define u_renderer (u->renderer)
+#define u_objects  (u->objects)
 
 const Scalar ball_size    = .125f;
 const Scalar court_length = 3.f;
@@ -57,48 +58,73 @@ Scalar sdf_walls(Vec3 origin)
     return fmax(walls, -ends);
 }
 
-Scalar sdf_ball(Vec3 origin)
+Scalar sdf_ball(Vec3 origin, const Uniforms* u)
 {
     return sdf_sphere(vec_sub(u_ball, origin), ball_size);
 }
 
-Scalar sdf_paddle_insides(Vec3 origin)
+Vec3 paddle_insides_size(void)
 {
     Vec3 size   = paddle_size;
     Vec2 scaled = vec_mul(vec_xy(size), .9f);
     vec_xy_assign(size, scaled);
     size.z += .01f;
-    return fmin(
-        sdf_box(vec_sub(u_player1, origin), size),
-        sdf_box(vec_sub(u_player2, origin), size));
+    return size;
 }
 
-Scalar sdf_paddles(Vec3 origin)
+// Objects that are culled are left out of this and following SDFs.
+Scalar sdf_paddle_insides(Vec3 origin, const Uniforms* u)
+{
+    Vec3   size = paddle_insides_size();
+    Scalar sdf  = 999999999.f;
+    if (u_objects & OBJECT_PLAYER1)
+        sdf = fmin(sdf, sdf_box(vec_sub(u_player1, origin), size));
+    if (u_objects & OBJECT_PLAYER2)
+        sdf = fmin(sdf, sdf_box(vec_sub(u_player2, origin), size));
+    return sdf;
+}
+
+// insides_sdf is sdf_paddle_insides(), which is carved out of the frames.
+Scalar sdf_paddles(Vec3 origin, Scalar insides_sdf, const Uniforms* u)
 {
     Scalar paddle_rounding = .75f;
-    Scalar outsides = fmin(
-        sdf_box_rounded(vec_sub(u_player1, origin), paddle_size, paddle_rounding),
-        sdf_box_rounded(vec_sub(u_player2, origin), paddle_size, paddle_rounding));
+    Scalar outsides = 999999999.f;
+    if (u_objects & OBJECT_PLAYER1)
+        outsides = fmin(outsides, sdf_box_rounded(vec_sub(u_player1, origin), paddle_size, paddle_rounding));
+    if (u_objects & OBJECT_PLAYER2)
+        outsides = fmin(outsides, sdf_box_rounded(vec_sub(u_player2, origin), paddle_size, paddle_rounding));
 
-    return fmax(outsides, -sdf_paddle_insides(origin));
+    return fmax(outsides, -insides_sdf);
 }
 
-Scalar sdf_scene(Vec3 origin)
+// Also writes sdf_paddle_insides() to glass_sdf, so ray_march() does not need
+// to evaluate it again.
+Scalar sdf_scene_glass(Vec3 origin, Scalar* glass_sdf, const Uniforms* u)
 {
-    Scalar sdf = 999999999.f;
-    sdf = fmin(sdf, sdf_walls(origin));
-    sdf = fmin(sdf, sdf_ball(origin));
-    sdf = fmin(sdf, sdf_paddles(origin));
+    Scalar sdf = sdf_walls(origin);
+    if (u_objects & OBJECT_BALL)
+        sdf = fmin(sdf, sdf_ball(origin, u));
+    *glass_sdf = 999999999.f;
+    if (u_objects & (OBJECT_PLAYER1 | OBJECT_PLAYER2)) {
+        *glass_sdf = sdf_paddle_insides(origin, u);
+        sdf = fmin(sdf, sdf_paddles(origin, *glass_sdf, u));
+    }
     return sdf;
 }
 
-Vec3 scene_normal(Vec3 origin)
+Scalar sdf_scene(Vec3 origin, const Uniforms* u)
+{
+    Scalar glass_sdf;
+    return sdf_scene_glass(origin, &glass_sdf, u);
+}
+
+Vec3 scene_normal(Vec3 origin, const Uniforms* u)
 {
     Vec2 e = vec2(NORMAL_EPSILON, 0);
     return vec_normalize(vec3(
-        sdf_scene(vec_add(origin, vec_xyy(e))) - sdf_scene(vec_sub(origin, vec_xyy(e))),
-        sdf_scene(vec_add(origin, vec_yxy(e))) - sdf_scene(vec_sub(origin, vec_yxy(e))),
-        sdf_scene(vec_add(origin, vec_yyx(e))) - sdf_scene(vec_sub(origin, vec_yyx(e)))));
+        sdf_scene(vec_add(origin, vec_xyy(e)), u) - sdf_scene(vec_sub(origin, vec_xyy(e)), u),
+        sdf_scene(vec_add(origin, vec_yxy(e)), u) - sdf_scene(vec_sub(origin, vec_yxy(e)), u),
+        sdf_scene(vec_add(origin, vec_yyx(e)), u) - sdf_scene(vec_sub(origin, vec_yyx(e)), u)));
 }
 
 // ----------------------------------------------------------------------------
@@ -110,7 +136,7 @@ typedef struct Light
     Vec3 color;
 } Light;
 
-Vec3 phong(Vec3 ray_pos, Vec3 ray_dir, Vec3 normal)
+Vec3 phong(Vec3 ray_pos, Vec3 ray_dir, Vec3 normal, const Uniforms* u)
 {
     Vec3 material_color    = vec3(.55f, .1f, .85f);
     Vec2 material_gradient = vec_add(vec_rb(material_color), vec_mul(vec2(.5f*ray_pos.z, -ray_pos.z), .2f));
@@ -149,16 +175,14 @@ Vec3 phong(Vec3 ray_pos, Vec3 ray_dir, Vec3 normal)
 // ----------------------------------------------------------------------------
 // Ray Marching
 
-Scalar u_time = 0.f;
-
-Vec3 ray_march(Vec3 ray_pos, Vec3 ray_dir)
+Vec3 ray_march(Vec3 ray_pos, Vec3 ray_dir, const Uniforms* u)
 {
     Vec3 surface_color = vec3(0);
     Scalar window_fog = 0.f;
     for (size_t i = 0; i < MAX_ITERATIONS; ++i)
     {
-        Scalar scene_sdf = sdf_scene(ray_pos);
-        Scalar glass_sdf = sdf_paddle_insides(ray_pos);
+        Scalar glass_sdf;
+        Scalar scene_sdf = sdf_scene_glass(ray_pos, &glass_sdf, u);
         Scalar sdf = fmin(scene_sdf, glass_sdf);
         if (sdf >= MAX_DISTANCE)
             break;
@@ -171,9 +195,9 @@ Vec3 ray_march(Vec3 ray_pos, Vec3 ray_dir)
             ray_pos = vec_add(ray_pos, vec_mul(ray_dir, 2.f*paddle_size.z));
             continue;
         }
-        Vec3 normal = scene_normal(ray_pos);
-        Vec3 contribution = phong(ray_pos, ray_dir, normal);
-        // if (sdf_ball(ray_pos) <= MIN_DISTANCE) { // uncomment for more coloured rotating ball
+        Vec3 normal = scene_normal(ray_pos, u);
+        Vec3 contribution = phong(ray_pos, ray_dir, normal, u);
+        // if (sdf_ball(ray_pos, u) <= MIN_DISTANCE) { // uncomment for more coloured rotating ball
         //     Vec3 rotated    = normal;
         //     Vec2 rotated_xy = vec2_rotate(vec_xy(rotated), 1.f*u_time);
         //     Vec2 rotated_zx = vec2_rotate(vec_zx(rotated), 1.f5*u_time);
@@ -187,64 +211,661 @@ Vec3 ray_march(Vec3 ray_pos, Vec3 ray_dir)
     return vec_add(surface_color, window_fog);
 }
 
+// ----------------------------------------------------------------------------
+// Ray Tracing
+//
+// Every primitive above has a closed form ray intersection, so instead of
+// sphere tracing we can intersect them directly and get exact normals without
+// extra sdf_scene() evaluations. Intersectors return the distance along the ray
+// or INFINITY if missed. Ray origins are relative to the center of the object
+// and ray directions are normalized without zero components, see ray_trace().
+
+typedef struct Hit
+{
+    Scalar t;
+    Vec3   normal;
+} Hit;
+
+#define NO_HIT ((Hit){ .t = INFINITY })
+
+Vec3 sign3(Vec3 v)
+{
+    return vec3(copysign(1.f, v.x), copysign(1.f, v.y), copysign(1.f, v.z));
+}
+
+// Returns entry distance, exit distance is written to t_far. Missed if entry
+// distance is greater than exit distance.
+Scalar intersect_box(Vec3 ray_pos, Vec3 ray_dir, Vec3 size, Scalar* t_far)
+{
+    Vec3 m  = vec_div(vec3(1), ray_dir);
+    Vec3 n  = vec_mul(m, ray_pos);
+    Vec3 k  = vec_mul(vec_abs(m), size);
+    Vec3 t1 = vec_sub(vec_mul(n, -1.f), k);
+    Vec3 t2 = vec_sub(k, n);
+    *t_far = fmin(fmin(t2.x, t2.y), t2.z);
+    return fmax(fmax(t1.x, t1.y), t1.z);
+}
+
+// Outward normal of box surface point
+Vec3 box_normal(Vec3 coords, Vec3 size)
+{
+    Vec3 surface = vec_sub(vec_abs(coords), size);
+    if (surface.x >= surface.y && surface.x >= surface.z)
+        return vec3(copysign(1.f, coords.x), 0, 0);
+    if (surface.y >= surface.z)
+        return vec3(0, copysign(1.f, coords.y), 0);
+    return vec3(0, 0, copysign(1.f, coords.z));
+}
+
+Scalar intersect_sphere(Vec3 ray_pos, Vec3 ray_dir, Scalar radius)
+{
+    Scalar b = vec_dot(ray_pos, ray_dir);
+    Scalar c = vec_dot(ray_pos, ray_pos) - radius*radius;
+    Scalar h = b*b - c;
+    if (h < 0.f)
+        return INFINITY;
+    Scalar t = -b - sqrt(h);
+    return t >= 0.f ? t : INFINITY;
+}
+
+// Edge cylinder parallel to one axis for intersect_box_rounded(). Returns the
+// closer one of the hit and t.
+Scalar intersect_box_rounded_edge(
+    Scalar dd, Scalar od, Scalar oo, Scalar pos, Scalar dir, Scalar extent, Scalar t)
+{
+    Scalar h = od*od - dd*oo;
+    if (h <= 0.f)
+        return t;
+    h = (-od - sqrt(h))/dd;
+    return h > 0.f && h < t && fabs(pos + dir*h) < extent ? h : t;
+}
+
+// Rounding is relative like in sdf_box_rounded(). Inigo Quilez's rounded box
+// intersector: clip against the bounding box, then if we did not enter through
+// a flat face, test the corner sphere and edge cylinders of the octant.
+Scalar intersect_box_rounded(Vec3 ray_pos, Vec3 ray_dir, Vec3 size, Scalar rounding)
+{
+    Scalar t_far;
+    Scalar t = intersect_box(ray_pos, ray_dir, size, &t_far);
+    if (t > t_far || t_far < 0.f)
+        return INFINITY;
+
+    rounding *= fmin(fmin(size.x, size.y), size.z);
+    size      = vec_sub(size, rounding);
+
+    Vec3 pos  = vec_add(ray_pos, vec_mul(ray_dir, t));
+    Vec3 sign = sign3(pos);
+    ray_pos   = vec_mul(ray_pos, sign);
+    ray_dir   = vec_mul(ray_dir, sign);
+    pos       = vec_sub(vec_mul(pos, sign), size);
+    pos       = vec_max(pos, vec_yzx(pos));
+    if (fmin(fmin(pos.x, pos.y), pos.z) < 0.f)
+        return t;
+
+    Vec3   oc = vec_sub(ray_pos, size);
+    Vec3   dd = vec_mul(ray_dir, ray_dir);
+    Vec3   oo = vec_mul(oc, oc);
+    Vec3   od = vec_mul(oc, ray_dir);
+    Scalar rr = rounding*rounding;
+
+    t = INFINITY;
+    Scalar b = od.x + od.y + od.z;
+    Scalar h = b*b - (oo.x + oo.y + oo.z - rr);
+    if (h > 0.f)
+        t = -b - sqrt(h);
+
+    t = intersect_box_rounded_edge(
+        dd.y + dd.z, od.y + od.z, oo.y + oo.z - rr, ray_pos.x, ray_dir.x, size.x, t);
+    t = intersect_box_rounded_edge(
+        dd.z + dd.x, od.z + od.x, oo.z + oo.x - rr, ray_pos.y, ray_dir.y, size.y, t);
+    t = intersect_box_rounded_edge(
+        dd.x + dd.y, od.x + od.y, oo.x + oo.y - rr, ray_pos.z, ray_dir.z, size.z, t);
+    return t;
+}
+
+Vec3 box_rounded_normal(Vec3 coords, Vec3 size, Scalar rounding)
+{
+    rounding *= fmin(fmin(size.x, size.y), size.z);
+    Vec3 surface = vec_max(vec3(0), vec_sub(vec_abs(coords), vec_sub(size, rounding)));
+    return vec_mul(sign3(coords), vec_normalize(surface));
+}
+
+// Rounded boxes are convex, so we find the exit by tracing back from a point
+// that is known to be outside.
+Scalar exit_box_rounded(Vec3 ray_pos, Vec3 ray_dir, Vec3 size, Scalar rounding)
+{
+    Scalar t_far;
+    intersect_box(ray_pos, ray_dir, size, &t_far);
+    Scalar t_back = t_far + 1.f;
+    return t_back - intersect_box_rounded(
+        vec_add(ray_pos, vec_mul(ray_dir, t_back)), vec_mul(ray_dir, -1.f), size, rounding);
+}
+
+// End planes are always behind the outer box, so the walls are just the outer
+// box with the rounded inner box carved out. Camera must be outside the walls.
+Hit trace_walls(Vec3 ray_pos, Vec3 ray_dir)
+{
+    Scalar separation    = 1.f + ball_size - .05f;
+    Vec3   outside_size  = vec3(court_length - .1f);
+    Vec3   inside_size   = vec3(separation, separation, court_length);
+    Scalar inside_rounding = .15f;
+
+    Scalar t_far;
+    Scalar t = intersect_box(ray_pos, ray_dir, outside_size, &t_far);
+    if (t > t_far || t < 0.f)
+        return NO_HIT;
+    Vec3 pos = vec_add(ray_pos, vec_mul(ray_dir, t));
+    if (sdf_box_rounded(pos, inside_size, inside_rounding) > 0.f)
+        return (Hit){ t, box_normal(pos, outside_size) };
+
+    t = exit_box_rounded(ray_pos, ray_dir, inside_size, inside_rounding);
+    if (t > t_far) // through the far end
+        return NO_HIT;
+    pos = vec_add(ray_pos, vec_mul(ray_dir, t));
+    return (Hit){ t, vec_mul(box_rounded_normal(pos, inside_size, inside_rounding), -1.f) };
+}
+
+Hit trace_ball(Vec3 ray_pos, Vec3 ray_dir, const Uniforms* u)
+{
+    ray_pos  = vec_sub(ray_pos, u_ball);
+    Scalar t = intersect_sphere(ray_pos, ray_dir, ball_size);
+    if (t == INFINITY)
+        return NO_HIT;
+    return (Hit){ t, vec_div(vec_add(ray_pos, vec_mul(ray_dir, t)), ball_size) };
+}
+
+// Frame can also be hit from the inside of the glass.
+Hit trace_paddle(Vec3 ray_pos, Vec3 ray_dir, Vec3 paddle)
+{
+    Scalar paddle_rounding = .75f;
+    Vec3   insides_size    = paddle_insides_size();
+
+    ray_pos  = vec_sub(ray_pos, paddle);
+    Scalar t = intersect_box_rounded(ray_pos, ray_dir, paddle_size, paddle_rounding);
+    if (t == INFINITY)
+        return NO_HIT;
+    Vec3 pos = vec_add(ray_pos, vec_mul(ray_dir, t));
+    if (sdf_box(pos, insides_size) > 0.f)
+        return (Hit){ t, box_rounded_normal(pos, paddle_size, paddle_rounding) };
+
+    intersect_box(ray_pos, ray_dir, insides_size, &t);
+    pos = vec_add(ray_pos, vec_mul(ray_dir, t));
+    if (sdf_box_rounded(pos, paddle_size, paddle_rounding) < 0.f)
+        return (Hit){ t, vec_mul(box_normal(pos, insides_size), -1.f) };
+    return NO_HIT;
+}
+
+// Ray marcher adds .1 fog for each step of 2*paddle_size.z it takes within
+// MIN_DISTANCE of glass. Count the same steps from the chord length.
+Scalar glass_fog(Vec3 ray_pos, Vec3 ray_dir, Vec3 paddle, Scalar t_max)
+{
+    Scalar t_far;
+    Vec3 size = vec_add(paddle_insides_size(), MIN_DISTANCE);
+    Scalar t  = intersect_box(vec_sub(ray_pos, paddle), ray_dir, size, &t_far);
+    Scalar chord = fmin(t_far, t_max) - fmax(t, 0.f);
+    if (chord <= 0.f)
+        return 0.f;
+    return .1f*ceil(chord/(2.f*paddle_size.z));
+}
+
+Vec3 ray_trace(Vec3 ray_pos, Vec3 ray_dir, const Uniforms* u)
+{
+    // Prevent 0*inf in intersect_box()
+    ray_dir.x = ray_dir.x == 0.f ? 1e-20f : ray_dir.x;
+    ray_dir.y = ray_dir.y == 0.f ? 1e-20f : ray_dir.y;
+    ray_dir.z = ray_dir.z == 0.f ? 1e-20f : ray_dir.z;
+
+    Hit hits[] = {
+        trace_walls(ray_pos, ray_dir),
+        u_objects & OBJECT_BALL    ? trace_ball(ray_pos, ray_dir, u)           : NO_HIT,
+        u_objects & OBJECT_PLAYER1 ? trace_paddle(ray_pos, ray_dir, u_player1) : NO_HIT,
+        u_objects & OBJECT_PLAYER2 ? trace_paddle(ray_pos, ray_dir, u_player2) : NO_HIT,
+    };
+    Hit hit = hits[0];
+    for (size_t i = 1; i < sizeof hits/sizeof hits[0]; ++i)
+        if (hits[i].t < hit.t)
+            hit = hits[i];
+
+    Scalar window_fog = 0.f;
+    if (u_objects & OBJECT_PLAYER1)
+        window_fog += glass_fog(ray_pos, ray_dir, u_player1, hit.t);
+    if (u_objects & OBJECT_PLAYER2)
+        window_fog += glass_fog(ray_pos, ray_dir, u_player2, hit.t);
+
+    Vec3 surface_color = vec3(0);
+    if (hit.t != INFINITY)
+        surface_color = phong(vec_add(ray_pos, vec_mul(ray_dir, hit.t)), ray_dir, hit.normal, u);
+    return vec_add(surface_color, window_fog);
+}
+
 // ----------------------------------------------------------------------------
 // Main Rendering
 
-Vec3 pixel_color(Vec2 uv, bool split_screen_player2)
+void uniforms_init(
+    Uniforms*          u,
+    const t_gamestate* gamestate,
+    Vec2               resolution,
+    Scalar             char_height,
+    Scalar             time)
+{
+    u->ball       = vec3(gamestate->ball.x, gamestate->ball.y, gamestate->ball.z);
+    u->player1    = vec3(gamestate->player1.x, gamestate->player1.y, -court_length);
+    u->player2    = vec3(gamestate->player2.x, gamestate->player2.y, +court_length);
+    u->player     = gamestate->player;
+    u->renderer   = gamestate->renderer;
+    u->quality    = gamestate->quality;
+    u->time       = time;
+    u->resolution = resolution;
+    u->objects    = OBJECTS_ALL;
+
+    u->camera_distance_from_screen = 1.f/tan((M_PI/360.f)*FIELD_OF_VIEW);
+    u->camera = vec3(0,0, -(court_length + u->camera_distance_from_screen + .4f));
+
+    // uv is affine in pixel coordinates, so instead of transforming every
+    // pixel, transform the scale and the offset. Additions only apply to the
+    // offset. First we map to [-1, 1] and center horizontally for non-square
+    // cells.
+    Scalar aspect_ratio = resolution.x/resolution.y;
+    Vec2   scale  = vec2(2.f/(char_height*resolution.x), -2.f/resolution.y);
+    Vec2   offset = vec2(-1.f/char_height, 1.f);
+
+    if (u->player != SPLIT_SCREEN)
+    {
+        if (resolution.x/char_height > resolution.y) {
+            scale.x  *= aspect_ratio;
+            offset.x *= aspect_ratio;
+        } else {
+            scale.y  *= char_height/aspect_ratio;
+            offset.y *= char_height/aspect_ratio;
+            scale.x  *= char_height;
+            offset.x *= char_height;
+        }
+        u->split_x      = resolution.x;
+        u->viewports[0] = (Viewport){ scale, offset, u->player == PLAYER2 };
+        u->viewports[1] = u->viewports[0];
+        return;
+    }
+
+    scale.x  *= char_height;
+    offset.x *= char_height;
+    scale     = vec_mul(scale,  2.f);
+    offset    = vec_mul(offset, 2.f);
+    offset.x += 1.f;
+    u->split_x = .5f*resolution.x; // where uv.x reaches 1
+
+    Vec2 viewport_scale  = vec2(.5f*aspect_ratio/char_height, 1.f/char_height);
+    if (.5f*resolution.x/char_height <= resolution.y)
+        viewport_scale = vec_div(viewport_scale, .5f*aspect_ratio/char_height);
+
+    u->viewports[0] = (Viewport){
+        vec_mul(scale,  viewport_scale),
+        vec_mul(offset, viewport_scale),
+        false };
+    offset.x -= 2.f; // right side is rotated to face player 2
+    u->viewports[1] = (Viewport){
+        vec_mul(vec_mul(scale,  -1.f), viewport_scale),
+        vec_mul(vec_mul(offset, -1.f), viewport_scale),
+        true };
+}
+
+void camera_ray(Vec3* ray_pos, Vec3* ray_dir, Vec2 coords, const Uniforms* u)
 {
-    const Scalar camera_distance_from_screen = 1.f/tan((M_PI/360.f)*FIELD_OF_VIEW);
+    const Viewport* viewport = &u->viewports[coords.x >= u->split_x];
+    Vec2 uv = vec_add(vec_mul(coords, viewport->uv_scale), viewport->uv_offset);
 
-    Vec3 ray_pos = vec3(0,0, -(court_length + camera_distance_from_screen + .4f));
-    Vec3 ray_dir = vec_normalize(vec3(uv, camera_distance_from_screen));
+    *ray_pos = u->camera;
+    *ray_dir = vec_normalize(vec3(uv, u->camera_distance_from_screen));
 
-    if (u_player == PLAYER2 || split_screen_player2) {
-        ray_pos.z *= -1.f;
-        ray_dir.z *= -1.f;
+    if (viewport->mirrored) {
+        ray_pos->z *= -1.f;
+        ray_dir->z *= -1.f;
     }
-    return ray_march(ray_pos, ray_dir);
 }
 
-Vec4 main_image(
-    Vec2 i_coords,
-    Vec2 i_resolution,
-    Scalar aspect_ratio,
-    Scalar char_height,
-    Scalar time,
-    t_gamestate gamestate)
+RGBA8 output_color(Vec3 frag_color)
+{
+    Vec3 gamma_corrected = vec_clamp(vec_pow(frag_color, vec3(1.f/2.2f)), 0.f, 1.f);
+    return (RGBA8){
+        255.f*gamma_corrected.r + .5f,
+        255.f*gamma_corrected.g + .5f,
+        255.f*gamma_corrected.b + .5f,
+        255 };
+}
+
+RGBA8 main_image(Vec2 coords, const Uniforms* u)
+{
+    Vec3 ray_pos;
+    Vec3 ray_dir;
+    camera_ray(&ray_pos, &ray_dir, coords, u);
+
+    Vec3 frag_color;
+    if (u_renderer == RENDERER_RAY_TRACING)
+        frag_color = ray_trace(ray_pos, ray_dir, u);
+    else
+        frag_color = ray_march(ray_pos, ray_dir, u);
+    return output_color(frag_color);
+}
+
+// ----------------------------------------------------------------------------
+// Court Cache
+//
+// Walls never move, so where camera rays hit them only changes with the camera.
+// Lights do move with the ball and paddles though, and they have no falloff,
+// so cached hits are still shaded every frame, which is cheap compared to
+// finding them. Only pixels whose rays can reach the ball or a paddle need the
+// full renderer.
+
+Vec3 walls_normal(Vec3 origin)
+{
+    Vec2 e = vec2(NORMAL_EPSILON, 0);
+    return vec_normalize(vec3(
+        sdf_walls(vec_add(origin, vec_xyy(e))) - sdf_walls(vec_sub(origin, vec_xyy(e))),
+        sdf_walls(vec_add(origin, vec_yxy(e))) - sdf_walls(vec_sub(origin, vec_yxy(e))),
+        sdf_walls(vec_add(origin, vec_yyx(e))) - sdf_walls(vec_sub(origin, vec_yyx(e)))));
+}
+
+CourtSample court_sample(Vec2 coords, const Uniforms* u)
 {
-    GAMESTATE = gamestate;
-    u_time = time;
-    bool split_screen_player2 = false;
+    Vec3 ray_pos;
+    Vec3 ray_dir;
+    camera_ray(&ray_pos, &ray_dir, coords, u);
 
-    Vec2 uv = vec_sub(vec_mul(vec_div(i_coords, i_resolution), 2.f), 1.f);
-    if (u_player != SPLIT_SCREEN)
+    CourtSample sample = { .hit = false };
+    if (u_renderer == RENDERER_RAY_TRACING)
     {
-        if (i_resolution.x/char_height > i_resolution.y)
-            uv.x *= aspect_ratio;
-        else {
-            uv.y /= aspect_ratio;
-            uv = vec_mul(uv, char_height);
+        ray_dir.x = ray_dir.x == 0.f ? 1e-20f : ray_dir.x;
+        ray_dir.y = ray_dir.y == 0.f ? 1e-20f : ray_dir.y;
+        ray_dir.z = ray_dir.z == 0.f ? 1e-20f : ray_dir.z;
+
+        Hit hit = trace_walls(ray_pos, ray_dir);
+        if (hit.t != INFINITY)
+            sample = (CourtSample){ vec_add(ray_pos, vec_mul(ray_dir, hit.t)), hit.normal, true };
+        return sample;
+    }
+
+    for (size_t i = 0; i < MAX_ITERATIONS; ++i)
+    {
+        Scalar sdf = sdf_walls(ray_pos);
+        if (sdf >= MAX_DISTANCE)
+            break;
+        if (sdf >= MIN_DISTANCE) {
+            ray_pos = vec_add(ray_pos, vec_mul(ray_dir, sdf));
+            continue;
         }
+        sample = (CourtSample){ ray_pos, walls_normal(ray_pos), true };
+        break;
     }
-    else
+    return sample;
+}
+
+RGBA8 court_image(CourtSample sample, Vec2 coords, const Uniforms* u)
+{
+    Vec3 frag_color = vec3(0);
+    if (sample.hit) {
+        Vec3 ray_pos;
+        Vec3 ray_dir;
+        camera_ray(&ray_pos, &ray_dir, coords, u);
+        frag_color = phong(sample.position, ray_dir, sample.normal, u);
+    }
+    return output_color(frag_color);
+}
+
+// Bounds the pixels of a viewport whose rays can hit the box at center +- size
+// by projecting its corners. Empty if out of view.
+IRect project_box(Vec3 center, Vec3 size, int viewport_index, const Uniforms* u)
+{
+    const Viewport* viewport = &u->viewports[viewport_index];
+    Scalar x_begin = viewport_index == 0 ? 0.f : ceil(u->split_x);
+    Scalar x_end   = viewport_index == 0 ? ceil(u->split_x) : u->resolution.x;
+
+    Vec3 camera = u->camera;
+    if (viewport->mirrored)
+        camera.z *= -1.f;
+
+    Vec2 min = vec2(INFINITY);
+    Vec2 max = vec2(-INFINITY);
+    for (int i = 0; i < 8; ++i)
     {
-        uv.x *= char_height;
-        uv = vec_mul(uv, 2.f);
-        uv.x += 1.f;
-        if (uv.x >= 1.f) {
-            uv.x -= 2.f;
-            uv = vec_mul(uv, -1.f);
-            split_screen_player2 = true;
+        Vec3 corner = vec3(i & 1 ? 1.f : -1.f, i & 2 ? 1.f : -1.f, i & 4 ? 1.f : -1.f);
+        Vec3 ray    = vec_sub(vec_add(center, vec_mul(corner, size)), camera);
+        if (viewport->mirrored)
+            ray.z *= -1.f;
+        if (ray.z <= 0.f) { // behind camera, could be anywhere
+            min = vec2(-INFINITY);
+            max = vec2(INFINITY);
+            break;
         }
-        uv.x *= .5f*aspect_ratio;
-        uv = vec_div(uv, char_height);
-        if (.5f*i_resolution.x/char_height <= i_resolution.y)
-            uv = vec_div(uv, .5f*aspect_ratio/char_height);
+        Vec2 uv    = vec_mul(vec_xy(ray), u->camera_distance_from_screen/ray.z);
+        Vec2 pixel = vec_div(vec_sub(uv, viewport->uv_offset), viewport->uv_scale);
+        min = vec_min(min, pixel);
+        max = vec_max(max, pixel);
+    }
+    // Pixels sample at their integer coordinates, floor() and ceil() leave one
+    // pixel margin for rounding.
+    return (IRect){
+        .x0 = fmax(floor(min.x), x_begin),
+        .y0 = fmax(floor(min.y), 0.f),
+        .x1 = fmin(ceil(max.x) + 1.f, x_end),
+        .y1 = fmin(ceil(max.y) + 1.f, u->resolution.y),
+    };
+}
+
+int dynamic_rects(
+    IRect           rects[VEC_STATIC DYNAMIC_RECTS_MAX],
+    int             objects[VEC_STATIC DYNAMIC_RECTS_MAX],
+    const Uniforms* u)
+{
+    // Ray marcher hits within MIN_DISTANCE so objects look that much bigger.
+    // Glass sticks out of the frames a little.
+    Vec3 ball_bounds   = vec3(ball_size + MIN_DISTANCE);
+    Vec3 paddle_bounds = vec_add(vec_max(paddle_size, paddle_insides_size()), MIN_DISTANCE);
+
+    int viewports_length = u->player == SPLIT_SCREEN ? 2 : 1;
+    int rects_length = 0;
+    for (int i = 0; i < viewports_length; ++i)
+    {
+        IRect viewport_rects[] = {
+            project_box(u_ball,    ball_bounds,   i, u),
+            project_box(u_player1, paddle_bounds, i, u),
+            project_box(u_player2, paddle_bounds, i, u),
+        };
+        int viewport_objects[] = { OBJECT_BALL, OBJECT_PLAYER1, OBJECT_PLAYER2 };
+        for (size_t j = 0; j < sizeof viewport_rects/sizeof viewport_rects[0]; ++j)
+            if (viewport_rects[j].x0 < viewport_rects[j].x1 && viewport_rects[j].y0 < viewport_rects[j].y1) {
+                objects[rects_length] = viewport_objects[j];
+                rects[rects_length++] = viewport_rects[j];
+            }
+    }
+    return rects_length;
+}
+
+// ----------------------------------------------------------------------------
+// Packet Ray Marching
+//
+// Ray marching for VEC_PACKET_WIDTH horizontally adjacent pixels at once. Rays
+// of neighbouring pixels take similar paths, so lanes that terminate early are
+// just masked out until the whole packet is done.
+
+#if VEC_PACKETS
+
+ScalarxN sdf_sphere_xn(Vec3xN coords, Scalar radius)
+{
+    return vec3xn_length(coords) - radius;
+}
+
+ScalarxN sdf_box_xn(Vec3xN coords, Vec3 size)
+{
+    coords           = vec3xn_abs(coords);
+    Vec3xN   surface = vec3xn_sub(coords, vec3xn_initv3(size));
+    ScalarxN outside = vec3xn_length(vec3xn_max(vec3xn_initv3(vec3(0)), surface));
+    ScalarxN inside  = sxn_min(sxn_inits(0.f), sxn_max(sxn_max(surface.x, surface.y), surface.z));
+    return outside + inside;
+}
+
+ScalarxN sdf_box_rounded_xn(Vec3xN coords, Vec3 size, Scalar rounding)
+{
+    rounding *= fmin(fmin(size.x, size.y), size.z);
+    return sdf_box_xn(coords, vec_sub(size, rounding)) - rounding;
+}
+
+ScalarxN sdf_walls_xn(Vec3xN origin)
+{
+    Scalar   separation    = 1.f + ball_size - .05f;
+    ScalarxN walls_outside = sdf_box_xn(origin, vec3(court_length - .1f));
+    ScalarxN walls_inside  = sdf_box_rounded_xn(origin, vec3(separation, separation, court_length), .15f);
+    ScalarxN walls = sxn_max(walls_outside, -walls_inside);
+
+    ScalarxN ends = court_length - sxn_abs(origin.z);
+    return sxn_max(walls, -ends);
+}
+
+ScalarxN sdf_ball_xn(Vec3xN origin, const Uniforms* u)
+{
+    return sdf_sphere_xn(vec3xn_sub(vec3xn_initv3(u_ball), origin), ball_size);
+}
+
+ScalarxN sdf_paddle_insides_xn(Vec3xN origin, const Uniforms* u)
+{
+    Vec3     size = paddle_insides_size();
+    ScalarxN sdf  = sxn_inits(999999999.f);
+    if (u_objects & OBJECT_PLAYER1)
+        sdf = sxn_min(sdf, sdf_box_xn(vec3xn_sub(vec3xn_initv3(u_player1), origin), size));
+    if (u_objects & OBJECT_PLAYER2)
+        sdf = sxn_min(sdf, sdf_box_xn(vec3xn_sub(vec3xn_initv3(u_player2), origin), size));
+    return sdf;
+}
+
+ScalarxN sdf_paddles_xn(Vec3xN origin, ScalarxN insides_sdf, const Uniforms* u)
+{
+    Scalar   paddle_rounding = .75f;
+    ScalarxN outsides = sxn_inits(999999999.f);
+    if (u_objects & OBJECT_PLAYER1)
+        outsides = sxn_min(outsides, sdf_box_rounded_xn(
+            vec3xn_sub(vec3xn_initv3(u_player1), origin), paddle_size, paddle_rounding));
+    if (u_objects & OBJECT_PLAYER2)
+        outsides = sxn_min(outsides, sdf_box_rounded_xn(
+            vec3xn_sub(vec3xn_initv3(u_player2), origin), paddle_size, paddle_rounding));
+
+    return sxn_max(outsides, -insides_sdf);
+}
+
+ScalarxN sdf_scene_glass_xn(Vec3xN origin, ScalarxN* glass_sdf, const Uniforms* u)
+{
+    ScalarxN sdf = sdf_walls_xn(origin);
+    if (u_objects & OBJECT_BALL)
+        sdf = sxn_min(sdf, sdf_ball_xn(origin, u));
+    *glass_sdf = sxn_inits(999999999.f);
+    if (u_objects & (OBJECT_PLAYER1 | OBJECT_PLAYER2)) {
+        *glass_sdf = sdf_paddle_insides_xn(origin, u);
+        sdf = sxn_min(sdf, sdf_paddles_xn(origin, *glass_sdf, u));
+    }
+    return sdf;
+}
+
+ScalarxN sdf_scene_xn(Vec3xN origin, const Uniforms* u)
+{
+    ScalarxN glass_sdf;
+    return sdf_scene_glass_xn(origin, &glass_sdf, u);
+}
+
+Vec3xN scene_normal_xn(Vec3xN origin, const Uniforms* u)
+{
+    ScalarxN e = sxn_inits(NORMAL_EPSILON);
+    ScalarxN o = sxn_inits(0.f);
+    Vec3xN ex = vec3xn_init(e, o, o);
+    Vec3xN ey = vec3xn_init(o, e, o);
+    Vec3xN ez = vec3xn_init(o, o, e);
+    return vec3xn_normalize(vec3xn_init(
+        sdf_scene_xn(vec3xn_add(origin, ex), u) - sdf_scene_xn(vec3xn_sub(origin, ex), u),
+        sdf_scene_xn(vec3xn_add(origin, ey), u) - sdf_scene_xn(vec3xn_sub(origin, ey), u),
+        sdf_scene_xn(vec3xn_add(origin, ez), u) - sdf_scene_xn(vec3xn_sub(origin, ez), u)));
+}
+
+Vec3xN phong_xn(Vec3xN ray_pos, Vec3xN ray_dir, Vec3xN normal, const Uniforms* u)
+{
+    Vec3xN material_color = vec3xn_init(
+        .55f + .2f*.5f*ray_pos.z,
+        sxn_inits(.1f),
+        .85f - .2f*ray_pos.z);
+
+    Vec3 lights[LIGHTS_COUNT] = {
+        u_ball,
+        vec_add(u_player1, vec3(0,0,-.5f)),
+        vec_sub(u_player2, vec3(0,0,-.5f)),
+    };
+
+    Vec3xN surface_color = vec3xn_initv3(vec3(0));
+
+    for (size_t i = 0; i < LIGHTS_COUNT; ++i)
+    {
+        Vec3xN light_dir      = vec3xn_normalize(vec3xn_sub(vec3xn_initv3(lights[i]), ray_pos));
+        Vec3xN reflection_dir = vec3xn_reflect(light_dir, normal);
+
+        ScalarxN diffuse = sxn_max(sxn_inits(0.f), vec3xn_dot(light_dir, normal));
+        if (i == 0)
+            diffuse *= 3.f*diffuse*diffuse;
+        ScalarxN specular = sxn_max(sxn_inits(0.f), vec3xn_dot(ray_dir, reflection_dir));
+        for (size_t j = 0; j < 9; ++j) // pow(specular, 512.f)
+            specular *= specular;
+
+        surface_color = vec3xn_add(
+            surface_color,
+            vec3xn_adds(vec3xn_muls(material_color, .5f*diffuse), .1f*specular));
+    }
+    return surface_color;
+}
+
+Vec3xN ray_march_xn(Vec3xN ray_pos, Vec3xN ray_dir, const Uniforms* u)
+{
+    ScalarxN     window_fog = sxn_inits(0.f);
+    ScalarMaskxN active     = window_fog == 0.f;
+    ScalarMaskxN hit        = ~active;
+    for (size_t i = 0; i < MAX_ITERATIONS && sxn_any(active); ++i)
+    {
+        ScalarxN glass_sdf;
+        ScalarxN scene_sdf = sdf_scene_glass_xn(ray_pos, &glass_sdf, u);
+        ScalarxN sdf = sxn_min(scene_sdf, glass_sdf);
+
+        active &= sdf < MAX_DISTANCE;
+        ScalarMaskxN surface = active & (sdf < MIN_DISTANCE);
+        ScalarMaskxN glass   = surface & (glass_sdf <= MIN_DISTANCE);
+        hit    |= surface & ~glass;
+        active &= ~hit;
+
+        window_fog += sxn_select(glass, sxn_inits(.1f), sxn_inits(0.f));
+        ScalarxN step = sxn_select(glass, sxn_inits(2.f*paddle_size.z), sdf);
+        step    = sxn_select(active, step, sxn_inits(0.f));
+        ray_pos = vec3xn_add(ray_pos, vec3xn_muls(ray_dir, step));
+    }
+    Vec3xN surface_color = vec3xn_initv3(vec3(0));
+    if (sxn_any(hit)) {
+        Vec3xN normal = scene_normal_xn(ray_pos, u);
+        surface_color = vec3xn_select(hit, phong_xn(ray_pos, ray_dir, normal, u), surface_color);
+    }
+    return vec3xn_adds(surface_color, window_fog);
+}
+
+void main_image_packet(RGBA8 out[VEC_STATIC VEC_PACKET_WIDTH], Vec2 coords, const Uniforms* u)
+{
+    Vec3xN ray_pos;
+    Vec3xN ray_dir;
+    for (int i = 0; i < VEC_PACKET_WIDTH; ++i)
+    {
+        Vec3 lane_pos;
+        Vec3 lane_dir;
+        camera_ray(&lane_pos, &lane_dir, vec2(coords.x + i, coords.y), u);
+        ray_pos.x[i] = lane_pos.x;
+        ray_pos.y[i] = lane_pos.y;
+        ray_pos.z[i] = lane_pos.z;
+        ray_dir.x[i] = lane_dir.x;
+        ray_dir.y[i] = lane_dir.y;
+        ray_dir.z[i] = lane_dir.z;
     }
 
-    Vec3 frag_color = pixel_color(uv, split_screen_player2);
+    Vec3xN frag_color = ray_march_xn(ray_pos, ray_dir, u);
 
-    Vec3 gamma_corrected = vec_pow(frag_color, vec3(1.f/2.2f));
-    return vec4(gamma_corrected, 1.f);
+    for (int i = 0; i < VEC_PACKET_WIDTH; ++i)
+        out[i] = output_color(vec3xn_lane(frag_color, i));
 }
 
+#endif // VEC_PACKETS
@@ -192,15 +192,15 @@ float3 pixel_color(
 }
 
 kernel void main_image(
-    global float4* out,
+    global uchar4* out,
     float3         ball,
     float2         player1xy,
     float2         player2xy,
     float          char_height,
-    int            player)
+    int            player,
+    uint2          i_resolution) // global size may only cover the top rows
 {
     uint2 i_coords     = (uint2)(get_global_id(0),   get_global_id(1));
-    uint2 i_resolution = (uint2)(get_global_size(0), get_global_size(1));
     float2 coords     = convert_float2(i_coords);
     float2 resolution = convert_float2(i_resolution);
     coords.x /= char_height;
@@ -241,5 +241,79 @@ kernel void main_image(
     float3 frag_color = pixel_color(uv, split_screen_player2, ball, player1, player2, player);
 
     float3 gamma_corrected = pow(frag_color, (float3)(1.f/2.2f));
-    out[i_coords.y*i_resolution.x + i_coords.x] = (float4)(gamma_corrected, 1.f);
+    out[i_coords.y*i_resolution.x + i_coords.x] = convert_uchar4_sat_rte(255.f*(float4)(gamma_corrected, 1.f));
+}
+
+// ----------------------------------------------------------------------------
+// Cells
+
+// Splits cells of 2 pixels wide and cell_height high of image to back and front
+// colors like make_cell() in tengine.c, so only 7 bytes per cell has to be read
+// back: glyph, fg and bg.
+#define CELL_PIXELS_MAX       8
+#define CELL_SPLIT_ITERATIONS 4
+
+kernel void make_cells(global const uchar4* image, global uchar* cells, int cell_height)
+{
+    uint2 i_coords = (uint2)(get_global_id(0), get_global_id(1));
+    uint  columns  = get_global_size(0);
+    uint  width    = 2*columns;
+    int   length   = 2*cell_height;
+
+    int4 colors[CELL_PIXELS_MAX];
+    int4 color_max = 0;
+    int4 color_min = 255;
+    for (int i = 0; i < length; ++i) {
+        colors[i] = convert_int4(image[(cell_height*i_coords.y + i/2)*width + 2*i_coords.x + i%2]);
+        color_max = max(color_max, colors[i]);
+        color_min = min(color_min, colors[i]);
+    }
+
+    // Split at the middle of the channel the colors differ most in
+    int4 range   = color_max - color_min;
+    int4 channel = range.x >= range.y && range.x >= range.z ? (int4)(1, 0, 0, 0)
+                 : range.y >= range.z                       ? (int4)(0, 1, 0, 0)
+                 :                                            (int4)(0, 0, 1, 0);
+    int4 channel_max = color_max*channel;
+    int4 channel_min = color_min*channel;
+    int  value_max   = channel_max.x + channel_max.y + channel_max.z;
+    int  value_min   = channel_min.x + channel_min.y + channel_min.z;
+    uint glyph       = 0;
+    for (int i = 0; i < length; ++i) {
+        int4 channel_value = colors[i]*channel;
+        int  value         = channel_value.x + channel_value.y + channel_value.z;
+        glyph |= (value_max - value < value - value_min) << i;
+    }
+
+    int4 averages[2]; // back and front
+    for (int iteration = 0; ; ++iteration)
+    {
+        int4 sums[2]  = { (int4)(0), (int4)(0) };
+        int  elems[2] = { 0, 0 };
+        for (int i = 0; i < length; ++i) {
+            sums[glyph >> i & 1] += colors[i];
+            elems[glyph >> i & 1]++;
+        }
+        for (int j = 0; j < 2; ++j)
+            averages[j] = elems[j] == 0 ? (int4)(0) : (sums[j] + elems[j]/2)/elems[j];
+        if (elems[0] == 0 || elems[1] == 0 || iteration == CELL_SPLIT_ITERATIONS)
+            break;
+
+        uint nearer = 0;
+        for (int i = 0; i < length; ++i) {
+            int4 back  = colors[i] - averages[0];
+            int4 front = colors[i] - averages[1];
+            back  *= back;
+            front *= front;
+            nearer |= (front.x + front.y + front.z < back.x + back.y + back.z) << i;
+        }
+        if (nearer == glyph)
+            break;
+        glyph = nearer;
+    }
+
+    global uchar* cell = cells + 7*(i_coords.y*columns + i_coords.x);
+    cell[0] = glyph;
+    vstore3(convert_uchar3(averages[1].xyz), 0, cell + 1);
+    vstore3(convert_uchar3(averages[0].xyz), 0, cell + 4);
 }
@@ -31,11 +31,12 @@ static void handle_mouse_move(IVec2 coords, void*_out)
     if ( ! g_gamestate_ptr->game_running)
         return;
     Vec2 mouse_pos = tengi_estimate_pixel_to_cell(coords);
+    int  hovered   = g_gamestate_ptr->hovered;
 
     if (g_gamestate_ptr->menu_state == MENU_GAME_ROOT)
     {
-        if (mouse_pos.x >= strlen("Select hardware accelerator") ||
-            mouse_pos.y >= 2.f)
+        if (mouse_pos.x >= MENU_GAME_ROOT_LENGTH ||
+            mouse_pos.y >= MENU_ROOT_LENGTH)
             g_gamestate_ptr->hovered = -1;
         else
             g_gamestate_ptr->hovered = mouse_pos.y;
@@ -47,6 +48,8 @@ static void handle_mouse_move(IVec2 coords, void*_out)
         else
             g_gamestate_ptr->hovered = mouse_pos.y;
     }
+    if (g_gamestate_ptr->hovered != hovered)
+        gamestate_changed(g_gamestate_ptr);
 }
 
 static void handle_key_press(XKeyPressedEvent* xev, void*_out)
@@ -99,11 +102,29 @@ static void handle_mouse_press(IVec2 cell, void* _events)
     if (g_gamestate_ptr->game_running) switch (g_gamestate_ptr->menu_state)
     {
     case MENU_GAME_ROOT:
-        if (coords.y < 1.f && coords.x < strlen("Select hardware accelerator"))
+        if (coords.x >= MENU_GAME_ROOT_LENGTH)
+            break;
+        switch ((int)fmax(coords.y, 0.f))
+        {
+        case MENU_ROOT_SELECT_ACCELERATOR:
             g_gamestate_ptr->menu_state = MENU_SELECT_ACCELERATOR;
-        else if (coords.y < 2.f && coords.x < strlen("Select hardware accelerator")) {
+            break;
+        case MENU_ROOT_RENDERER:
+            g_gamestate_ptr->renderer = (g_gamestate_ptr->renderer + 1) % RENDERER_LENGTH;
+            break;
+        case MENU_ROOT_QUALITY:
+            g_gamestate_ptr->quality = (g_gamestate_ptr->quality + 1) % QUALITY_LENGTH;
+            break;
+        case MENU_ROOT_COLORS:
+            g_gamestate_ptr->colors = (g_gamestate_ptr->colors + 1) % COLORS_LENGTH;
+            break;
+        case MENU_ROOT_GLYPHS:
+            g_gamestate_ptr->glyphs = (g_gamestate_ptr->glyphs + 1) % GLYPHS_LENGTH;
+            break;
+        case MENU_ROOT_EXIT:
             g_gamestate_ptr->game_running = false;
             events->exiting_game = true;
+            break;
         }
         break;
 
@@ -113,6 +134,7 @@ static void handle_mouse_press(IVec2 cell, void* _events)
         g_gamestate_ptr->menu_state = MENU_GAME_ROOT;
         break;
     }
+    gamestate_changed(g_gamestate_ptr);
 }
 
 static void handle_enter_window(XEnterWindowEvent* xev, void*_)
@@ -173,6 +195,7 @@ static void handle_resize_window(XConfigureEvent* xev, void*_events)
 
     if (g_gamestate_ptr->game_running) {
         g_gamestate_ptr->resize_timer = 0;
+        gamestate_changed(g_gamestate_ptr);
         return; // let tengine redraw
     }
 
@@ -172,6 +172,8 @@ void r_update_game_state(json &json_payload)
     g_gamestate.ball    = gamestate.ball;
     g_gamestate.player1 = gamestate.player1;
     g_gamestate.player2 = gamestate.player2;
+    g_gamestate.changes++;
+    pthread_cond_signal(&g_gamestate.changed);
 	pthread_mutex_unlock(&(g_gamestate.lock));
 
 	/* PRINTING THE GAMESTATE FOR DEBUGGING PURPOSES
@@ -540,12 +542,15 @@ int main(int argc, char **argv)
 	// Init gamestate mutex lock
 	if (pthread_mutex_init(&(g_gamestate.lock), NULL) != 0)
 		{ std::cerr << "Mutex failed" << std::endl; return 1; }
+	if (pthread_cond_init(&(g_gamestate.changed), NULL) != 0)
+		{ std::cerr << "Condition variable failed" << std::endl; return 1; }
 
 	// Create thread for rendering
 	pthread_t	render_thread;
 	if (pthread_create(&render_thread, NULL, rendering_loop, (void*)&g_gamestate) != 0)
 	{
 		pthread_mutex_destroy(&g_gamestate.lock);
+		pthread_cond_destroy(&g_gamestate.changed);
 		std::cerr << "Thread creation failed" << std::endl;
 		return 1;
 	}
@@ -571,6 +576,7 @@ int main(int argc, char **argv)
     {
         g_should_quit = true;
         g_gamestate.exit_thread = true;
+        gamestate_changed(&g_gamestate);
         pthread_join(render_thread, NULL); // prevent clearing screen before error message shown
         std::cout << "Websocket connection failed" << std::endl;
     }
@@ -634,10 +640,13 @@ int main(int argc, char **argv)
 	pthread_mutex_lock(&(g_gamestate.lock));
 	g_gamestate.exit_thread = true;
 	g_gamestate.game_running = false;
+	g_gamestate.changes++;
+	pthread_cond_signal(&g_gamestate.changed);
 	pthread_mutex_unlock(&(g_gamestate.lock));
 
 	pthread_join(render_thread, NULL);
 	pthread_mutex_destroy(&g_gamestate.lock);
+	pthread_cond_destroy(&g_gamestate.changed);
 
 	// Join websocket thread
 	close_connection(&g_client, &g_connection);
@@ -1,11 +1,18 @@
 #define CL_TARGET_OPENCL_VERSION 300
 #include <CL/opencl.h>
 
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <tengi.h>
 #include <gamestate.h>
+#include <frag.h>
+#include <tile_pool.h>
 #include <vec.h>
 
 #define C_END     "\e[0m"
@@ -40,10 +47,12 @@ static Scalar sdf_sphere(Vec3 origin, Vec3 coords, Scalar radius)
     return vec3_length(vec3_sub(coords, origin)) - radius;
 }
 
-static Vec4 main_image(Vec2 i_coords, Vec2 i_resolution, Scalar aspect_ratio, Scalar time)
+static RGBA8 example_image(Vec2 i_coords, const Uniforms* u)
 {
-    Vec2 uv = vec_sub(vec_mul(vec_div(i_coords, i_resolution), 2.f), 1.f);
-    uv.x *= aspect_ratio;
+    Vec2 uv = vec_sub(vec_mul(vec_div(i_coords, u->resolution), 2.f), 1.f);
+    uv.y *= -1.f;
+    uv.x *= u->resolution.x/u->resolution.y;
+    Scalar time = u->time;
 
     Vec3 pixel_color = {0};
     Vec3 ray_origin = {0};
@@ -68,64 +77,735 @@ static Vec4 main_image(Vec2 i_coords, Vec2 i_resolution, Scalar aspect_ratio, Sc
         else
             pixel_color = vec3(1,0,fmax(0.f, uv.x - animate*uv.y - .75));
     }
-    return vec4(vec_pow(pixel_color, 1.f/2.2f), 1);
+    return output_color(pixel_color);
 }
-#else
-Vec4 main_image(Vec2 i_coords, Vec2 i_resolution, Scalar aspect_ratio, Scalar char_height, Scalar time, t_gamestate);
+#define main_image example_image
 #endif
 
 // ----------------------------------------------------------------------------
 // Library usage
 
-static void fill_render_buffer(Vec4 colors[], IVec2 resolution, t_gamestate gamestate)
+// Height of pixels relative to their width. Cells are split to
+// tengi_get_cell_pixels() of them.
+static Scalar pixel_height(Vec2 char_size)
 {
-    Vec2 char_size = tengi_estimate_cell_size();
-    if (char_size.x == 0.f) {
-        fprintf(stderr, "Character cell size is 0!\n");
+    IVec2 cell = tengi_get_cell_pixels();
+    return char_size.y/char_size.x*cell.x/cell.y;
+}
+
+// Same pixels map to same rays
+static bool same_camera(const Uniforms* u1, const Uniforms* u2)
+{
+    bool same = u1->resolution.x == u2->resolution.x && u1->resolution.y == u2->resolution.y
+        && u1->split_x == u2->split_x;
+    for (size_t i = 0; i < 2; ++i)
+    {
+        const Viewport* v1 = &u1->viewports[i];
+        const Viewport* v2 = &u2->viewports[i];
+        same = same
+            && v1->uv_scale.x  == v2->uv_scale.x  && v1->uv_scale.y  == v2->uv_scale.y
+            && v1->uv_offset.x == v2->uv_offset.x && v1->uv_offset.y == v2->uv_offset.y
+            && v1->mirrored    == v2->mirrored;
+    }
+    return same;
+}
+
+// Pixels that may differ from the last frame: the last and current bounds of
+// the ball and paddles. Moving lights also change the shading of the court a
+// little every frame, so a band of rows walking down the screen is damaged too,
+// refreshing the whole court every DAMAGE_REFRESH_FRAMES frames. Rows the CPU
+// renders from first_cpu_row on, but the device rendered last frame, have stale
+// colors and are damaged too, see render_and_draw_hybrid(). Rects are aligned
+// to cells, so all of their pixels are rendered.
+#define DAMAGE_REFRESH_FRAMES 4
+#define DAMAGE_RECTS_MAX      (2*DYNAMIC_RECTS_MAX + 2)
+
+static size_t frame_damage(
+    IRect damage[static DAMAGE_RECTS_MAX], const Uniforms* uniforms, int first_cpu_row, bool redraw)
+{
+    static Uniforms last_uniforms;
+    static IRect    last_rects[DYNAMIC_RECTS_MAX];
+    static int      last_rects_length;
+    static int      refresh_band;
+    static int      last_first_cpu_row;
+
+    IVec2  resolution    = { uniforms->resolution.x, uniforms->resolution.y };
+    IVec2  cell          = tengi_get_cell_pixels();
+    size_t damage_length = 0;
+
+    redraw = redraw
+        || ! same_camera(uniforms, &last_uniforms)
+        || uniforms->renderer != last_uniforms.renderer;
+    last_uniforms = *uniforms;
+
+    for (int i = 0; i < last_rects_length; ++i)
+        damage[damage_length++] = last_rects[i];
+    int objects[DYNAMIC_RECTS_MAX];
+    last_rects_length = dynamic_rects(last_rects, objects, uniforms);
+    for (int i = 0; i < last_rects_length; ++i)
+        damage[damage_length++] = last_rects[i];
+
+    int band_height = (resolution.y + DAMAGE_REFRESH_FRAMES - 1)/DAMAGE_REFRESH_FRAMES;
+    band_height     = (band_height + cell.y - 1)/cell.y*cell.y;
+    refresh_band    = (refresh_band + 1) % DAMAGE_REFRESH_FRAMES;
+    damage[damage_length++] = (IRect){
+        0,            refresh_band*band_height,
+        resolution.x, (refresh_band + 1)*band_height };
+
+    if (first_cpu_row < last_first_cpu_row)
+        damage[damage_length++] = (IRect){ 0, first_cpu_row, resolution.x, last_first_cpu_row };
+    last_first_cpu_row = first_cpu_row;
+
+    if (redraw) {
+        damage[0]     = (IRect){ 0, 0, resolution.x, resolution.y };
+        damage_length = 1;
+    }
+
+    for (size_t i = 0; i < damage_length; ++i) {
+        damage[i].x0 = damage[i].x0/cell.x*cell.x;
+        damage[i].y0 = damage[i].y0/cell.y*cell.y;
+        damage[i].x1 = fmin((damage[i].x1 + cell.x - 1)/cell.x*cell.x, resolution.x);
+        damage[i].y1 = fmin((damage[i].y1 + cell.y - 1)/cell.y*cell.y, resolution.y);
+    }
+    return damage_length;
+}
+
+// Rays only march or trace objects, see Uniforms.objects.
+static void render_span(RGBA8 row[], int x, int x_end, int y, int objects, const Uniforms* uniforms)
+{
+    Uniforms culled;
+    if (objects != uniforms->objects) {
+        culled         = *uniforms;
+        culled.objects = objects;
+        uniforms       = &culled;
+    }
+    #if VEC_PACKETS
+    if (uniforms->renderer == RENDERER_RAY_MARCHING_PACKETS)
+        for (; x + VEC_PACKET_WIDTH <= x_end; x += VEC_PACKET_WIDTH)
+            main_image_packet(&row[x], vec2(x, y), uniforms);
+    #endif
+    for (; x < x_end; ++x)
+        row[x] = main_image(vec2(x, y), uniforms);
+}
+
+// Frame state shared by all rows rendered on CPU
+typedef struct render_pass
+{
+    TilePool*          pool;
+    const Uniforms*    uniforms;
+    const CourtSample* court; // NULL if out of memory
+    const IRect*       damage;
+    size_t             damage_length;
+    IRect              rects[DYNAMIC_RECTS_MAX];
+    int                rects_objects[DYNAMIC_RECTS_MAX];
+    int                rects_length;
+
+    // QUALITY_CHECKERBOARD: court pixels where (x + y) % 2 != checkerboard keep
+    // the last frame, or are interpolated in stale rects, where the ball and
+    // paddles were, and rows the device rendered, see frame_damage(). -1 shades
+    // every pixel.
+    int                checkerboard;
+    IRect              stale[DYNAMIC_RECTS_MAX + 1];
+    int                stale_length;
+} RenderPass;
+
+typedef struct court_pass
+{
+    CourtSample*    court;
+    IVec2           resolution;
+    const Uniforms* uniforms;
+} CourtPass;
+
+static void court_row(int y, void* param)
+{
+    const CourtPass* pass = param;
+    for (int x = 0; x < pass->resolution.x; ++x)
+        pass->court[y*pass->resolution.x + x] = court_sample(vec2(x, y), pass->uniforms);
+}
+
+// Rows [first_row, resolution.y) are rendered
+static RenderPass render_pass_init(
+    TilePool*       pool,
+    IVec2           resolution,
+    const Uniforms* uniforms,
+    const IRect     damage[],
+    size_t          damage_length,
+    int             first_row)
+{
+    static CourtSample* court;
+    static Uniforms     last_uniforms;
+    static IRect        last_rects[DYNAMIC_RECTS_MAX];
+    static int          last_rects_length;
+    static int          last_first_row;
+    static unsigned     frame;
+
+    // Redrawn frames have no history to reuse
+    IRect everything = { 0, 0, resolution.x, resolution.y };
+    bool  history    = same_camera(uniforms, &last_uniforms)
+        && uniforms->renderer == last_uniforms.renderer
+        && ! (damage_length == 1 && memcmp(&damage[0], &everything, sizeof everything) == 0);
+
+    bool ray_traced      = uniforms->renderer      == RENDERER_RAY_TRACING;
+    bool last_ray_traced = last_uniforms.renderer  == RENDERER_RAY_TRACING;
+    if (court == NULL || ! same_camera(uniforms, &last_uniforms) || ray_traced != last_ray_traced)
+    { // (re)build court cache
+        free(court);
+        court = malloc(sizeof court[0] * resolution.x*resolution.y);
+        if (court != NULL) {
+            int rows[resolution.y];
+            for (int y = 0; y < resolution.y; ++y)
+                rows[y] = y;
+            CourtPass court_pass = { court, resolution, uniforms };
+            tile_pool_run(pool, rows, resolution.y, court_row, &court_pass, NULL);
+        }
+    }
+
+    RenderPass pass = { pool, uniforms, court, damage, damage_length, {{0}}, {0}, 0, -1, {{0}}, 0 };
+    pass.rects_length = dynamic_rects(pass.rects, pass.rects_objects, uniforms);
+    if (court == NULL) {
+        pass.rects[0] = everything;
+        pass.rects_objects[0] = OBJECTS_ALL;
+        pass.rects_length = 1;
+    }
+
+    // The refresh band of frame_damage() comes back every DAMAGE_REFRESH_FRAMES
+    // frames, and shades the other half each time.
+    if (uniforms->quality == QUALITY_CHECKERBOARD)
+    {
+        pass.checkerboard = frame/DAMAGE_REFRESH_FRAMES % 2;
+        pass.stale_length = history ? last_rects_length : 1;
+        if (history)
+            memcpy(pass.stale, last_rects, sizeof last_rects);
+        else
+            pass.stale[0] = everything;
+        if (history && first_row < last_first_row)
+            pass.stale[pass.stale_length++] = (IRect){ 0, first_row, resolution.x, last_first_row };
+    }
+    frame++;
+    last_uniforms  = *uniforms;
+    last_first_row = first_row;
+    memcpy(last_rects, pass.rects, sizeof last_rects);
+    last_rects_length = pass.rects_length;
+    return pass;
+}
+
+// Fills row[x_begin, x_end). Only pixels in damage are filled, others are left
+// as they were. Pixels in rects are rendered fully, but only with the objects
+// of the rects they are in.
+static void render_row(RGBA8 row[], int y, int x_begin, int x_end, const RenderPass* pass)
+{
+    enum {
+        PIXEL_SKIP,
+        PIXEL_COURT,
+        PIXEL_INTERPOLATE, // from neighbours, which are shaded
+        PIXEL_FULL,        // PIXEL_FULL + objects
+    };
+
+    int width = pass->uniforms->resolution.x;
+    unsigned char pixels[x_end - x_begin]; // indexed by x - x_begin
+    memset(pixels, PIXEL_SKIP, sizeof pixels);
+    for (size_t i = 0; i < pass->damage_length; ++i) {
+        int x0 = fmax(pass->damage[i].x0, x_begin);
+        int x1 = fmin(pass->damage[i].x1, x_end);
+        if (y >= pass->damage[i].y0 && y < pass->damage[i].y1 && x0 < x1)
+            memset(&pixels[x0 - x_begin], PIXEL_COURT, x1 - x0);
+    }
+    for (int i = 0; i < pass->rects_length; ++i)
+        if (y >= pass->rects[i].y0 && y < pass->rects[i].y1)
+            for (int x = fmax(pass->rects[i].x0, x_begin); x < fmin(pass->rects[i].x1, x_end); ++x)
+            {
+                unsigned char* pixel = &pixels[x - x_begin];
+                if (*pixel == PIXEL_COURT)
+                    *pixel = PIXEL_FULL;
+                if (*pixel >= PIXEL_FULL)
+                    *pixel = PIXEL_FULL + ((*pixel - PIXEL_FULL) | pass->rects_objects[i]);
+            }
+
+    // Neighbours have the other parity, but there may be none at the edges of
+    // odd widths
+    if (pass->checkerboard >= 0 && x_end - x_begin >= 2)
+        for (int x = x_begin + (x_begin + y + pass->checkerboard + 1) % 2; x < x_end; x += 2)
+        {
+            if (pixels[x - x_begin] != PIXEL_COURT)
+                continue;
+            pixels[x - x_begin] = PIXEL_SKIP;
+            for (int i = 0; i < pass->stale_length; ++i)
+                if (x >= pass->stale[i].x0 && x < pass->stale[i].x1 && y >= pass->stale[i].y0 && y < pass->stale[i].y1)
+                    pixels[x - x_begin] = PIXEL_INTERPOLATE;
+        }
+
+    for (int x = x_begin; x < x_end;)
+    {
+        int span_end = x + 1;
+        while (span_end < x_end && pixels[span_end - x_begin] == pixels[x - x_begin])
+            ++span_end;
+        if (pixels[x - x_begin] >= PIXEL_FULL)
+            render_span(row, x, span_end, y, pixels[x - x_begin] - PIXEL_FULL, pass->uniforms);
+        else if (pixels[x - x_begin] == PIXEL_COURT)
+            for (int i = x; i < span_end; ++i)
+                row[i] = court_image(pass->court[y*width + i], vec2(i, y), pass->uniforms);
+        x = span_end;
+    }
+
+    for (int x = x_begin; x < x_end; ++x)
+        if (pixels[x - x_begin] == PIXEL_INTERPOLATE)
+        {
+            RGBA8 left  = row[x > x_begin   ? x - 1 : x + 1];
+            RGBA8 right = row[x < x_end - 1 ? x + 1 : x - 1];
+            row[x] = (RGBA8){
+                (left.r + right.r + 1)/2, (left.g + right.g + 1)/2, (left.b + right.b + 1)/2, 255 };
+        }
+}
+
+// ----------------------------------------------------------------------------
+// Tiles
+//
+// CPU frames are split to tiles for the threads of TilePool. Tiles with the ball
+// or paddles take a lot longer, so the ones that were slowest in the last frame
+// are started first, and the cheap ones even out the threads at the end.
+
+#ifndef TILE_SIZE
+#define TILE_SIZE 16 // pixels, bands of tiles are cut to whole terminal rows
+#endif
+
+// Threads rendering tiles, 0 for all cores
+#ifndef RENDER_THREADS
+#define RENDER_THREADS 0
+#endif
+
+// Bind render threads to cores. Helps when nothing else runs on the machine.
+#ifndef RENDER_PIN_THREADS
+#define RENDER_PIN_THREADS 0
+#endif
+
+typedef struct tile_pass
+{
+    const RenderPass* pass;
+    RGBA8*            colors;
+    int               width;
+    int               tiles_x;
+    int               tile_height; // whole terminal rows
+    int               cell_height;
+    int               y_begin;
+    int               y_end;
+    bool              draw;
+    atomic_int*       band_tiles; // tiles left to render in each band
+} TilePass;
+
+static void render_tile(int tile, void* param)
+{
+    const TilePass* tiles = param;
+    int band = tile / tiles->tiles_x;
+    int x0   = tile % tiles->tiles_x * TILE_SIZE;
+    int x1   = fmin(x0 + TILE_SIZE, tiles->width);
+    int y0   = tiles->y_begin + band*tiles->tile_height;
+    int y1   = fmin(y0 + tiles->tile_height, tiles->y_end);
+    for (int y = y0; y < y1; ++y)
+        render_row(&tiles->colors[y*tiles->width], y, x0, x1, tiles->pass);
+
+    // Whoever finishes a band splits it to cells, so that is parallel too
+    if (tiles->draw && atomic_fetch_sub(&tiles->band_tiles[band], 1) == 1)
+        for (int y = y0; y < y1; y += tiles->cell_height)
+            tengi_draw_row(y/tiles->cell_height, &tiles->colors[y*tiles->width]);
+}
+
+typedef struct tile_cost
+{
+    float seconds;
+    int   tile;
+} TileCost;
+
+static int compare_tile_costs(const void* a, const void* b)
+{
+    const TileCost* cost1 = a;
+    const TileCost* cost2 = b;
+    if (cost1->seconds != cost2->seconds)
+        return cost1->seconds < cost2->seconds ? 1 : -1;
+    return cost1->tile - cost2->tile; // row major is cache friendly
+}
+
+// Renders pixel rows [y_begin, y_end) to colors. If draw, they are also drawn
+// between tengi_draw_begin() and tengi_draw_end(). y_begin must be the first
+// pixel row of a terminal row.
+static void render_tiles(RGBA8 colors[], const RenderPass* pass, int y_begin, int y_end, bool draw)
+{
+    static float* tile_seconds; // of the last frame, indexed by tile
+    static int    last_tiles_x, last_tiles_y, last_y_begin;
+
+    int cell_height = tengi_get_cell_pixels().y;
+    int tile_height = TILE_SIZE/cell_height*cell_height;
+    int width       = pass->uniforms->resolution.x;
+    int tiles_x     = (width + TILE_SIZE - 1)/TILE_SIZE;
+    int tiles_y     = (y_end - y_begin + tile_height - 1)/tile_height;
+    int length      = tiles_x*tiles_y;
+    if (length <= 0)
         return;
+    if (tiles_x != last_tiles_x || tiles_y != last_tiles_y || y_begin != last_y_begin || tile_seconds == NULL)
+    {
+        free(tile_seconds);
+        tile_seconds = calloc(length, sizeof tile_seconds[0]);
+        last_tiles_x = tiles_x;
+        last_tiles_y = tiles_y;
+        last_y_begin = y_begin;
     }
-    Scalar char_height = char_size.y/char_size.x;
-    Vec2 reso = vec2(resolution.x, resolution.y);
-	double time = tengi_time();
-
-    #pragma omp parallel for
-	for (int y = 0; y < resolution.y; ++y)
-	{
-		for (int x = 0; x < resolution.x; ++x)
-		{
-            Vec2 coords = vec2(x, resolution.y - y);
-            coords.x /= char_height;
-            coords.x -= .5f * (reso.x/char_height - reso.x);
-
-			colors[y*resolution.x + x]
-                = main_image(
-                    coords,
-                    reso,
-                    (Scalar)resolution.x/resolution.y,
-                    char_height,
-                    time,
-                    gamestate);
-		}
-	}
+
+    TileCost costs[length];
+    int      order[length];
+    for (int i = 0; i < length; ++i)
+        costs[i] = (TileCost){ tile_seconds != NULL ? tile_seconds[i] : 0.f, i };
+    qsort(costs, length, sizeof costs[0], compare_tile_costs);
+    for (int i = 0; i < length; ++i)
+        order[i] = costs[i].tile;
+
+    atomic_int band_tiles[tiles_y];
+    for (int i = 0; i < tiles_y; ++i)
+        atomic_init(&band_tiles[i], tiles_x);
+
+    TilePass tiles = { pass, colors, width, tiles_x, tile_height, cell_height, y_begin, y_end, draw, band_tiles };
+    tile_pool_run(pass->pool, order, length, render_tile, &tiles, tile_seconds);
+}
+
+static void fill_render_buffer(
+    TilePool*       pool,
+    RGBA8           colors[],
+    IVec2           resolution,
+    const Uniforms* uniforms,
+    const IRect     damage[],
+    size_t          damage_length)
+{
+    RenderPass pass = render_pass_init(pool, resolution, uniforms, damage, damage_length, 0);
+    render_tiles(colors, &pass, 0, resolution.y, false);
+}
+
+// Same as fill_render_buffer() and tengi_draw(), but bands of tiles are split
+// to cells by the thread finishing them, so that is parallel too.
+static void render_and_draw(
+    TilePool*       pool,
+    RGBA8           colors[],
+    IVec2           resolution,
+    const Uniforms* uniforms,
+    const char      text[],
+    const IRect     damage[],
+    size_t          damage_length)
+{
+    IRect everything = { 0, 0, resolution.x, resolution.y };
+    if (tengi_draw_begin(resolution, damage, damage_length)) {
+        damage        = &everything;
+        damage_length = 1;
+    }
+    RenderPass pass = render_pass_init(pool, resolution, uniforms, damage, damage_length, 0);
+    render_tiles(colors, &pass, 0, resolution.y, true);
+    tengi_draw_end(text);
+}
+
+// ----------------------------------------------------------------------------
+// Frame pacing
+//
+// Frames have absolute deadlines RENDER_FPS apart. Each frame starts as late as
+// it can while still being drawn before its deadline, so it shows the freshest
+// gamestate, and frames are shown at a steady rate regardless of how long they
+// take. If a frame can't make its deadline, it waits for the next one instead.
+
+#ifndef RENDER_FPS
+#define RENDER_FPS 60 // 0 renders as fast as possible
+#endif
+#define PACING_MARGIN .001 // seconds for waking up late
+
+typedef struct frame_pacer
+{
+    double     deadline;    // of the current frame, seconds of CLOCK_MONOTONIC
+    double     start;       // of the current frame
+    double     render_time; // decays slowly, but follows slow frames at once
+    FrameStats stats;
+} FramePacer;
+
+static double monotonic_seconds(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + 1e-9*time.tv_nsec;
+}
+
+// Sleeps until the next frame should start
+static void frame_pacer_wait(FramePacer* pacer)
+{
+    double now = monotonic_seconds();
+    if (RENDER_FPS <= 0) {
+        pacer->start = pacer->deadline = now;
+        return;
+    }
+    double period = 1./RENDER_FPS;
+    pacer->deadline += period;
+    double start = pacer->deadline - pacer->render_time - PACING_MARGIN;
+    if (start < now) { // late or was idle, keep the phase
+        double skipped = ceil((now - start)/period);
+        pacer->deadline += skipped*period;
+        start           += skipped*period;
+    }
+    struct timespec wake = { (time_t)start, (long)(1e9*(start - (time_t)start)) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+        ;
+    pacer->start = monotonic_seconds();
+}
+
+// Call after drawing a frame
+static void frame_pacer_done(FramePacer* pacer)
+{
+    double now         = monotonic_seconds();
+    double render_time = now - pacer->start;
+    pacer->render_time = fmax(render_time, .95*pacer->render_time + .05*render_time);
+    pacer->stats.frames++;
+    pacer->stats.missed_deadlines += RENDER_FPS > 0 && now > pacer->deadline;
+}
+
+// ----------------------------------------------------------------------------
+// Idle frames
+//
+// Everything a frame depends on is in FrameInputs. When it stays the same, so
+// does the frame, after IDLE_SETTLE_FRAMES frames: checkerboarded pixels and
+// the refresh band of frame_damage() need two rounds of DAMAGE_REFRESH_FRAMES
+// to catch up, and OpenCL frames are drawn OPENCL_FRAMES_IN_FLIGHT late. After
+// that rendering_loop() sleeps until gamestate_changed() wakes it up.
+
+#define IDLE_SETTLE_FRAMES (2*DAMAGE_REFRESH_FRAMES + OPENCL_FRAMES_IN_FLIGHT)
+#define IDLE_TIMEOUT       1 // seconds, terminals can be resized without events
+
+typedef struct frame_inputs
+{
+    t_ball    ball;
+    t_player  player1;
+    t_player  player2;
+    int       player;
+    MenuState menu_state;
+    size_t    selected_accelerator;
+    Renderer  renderer;
+    Quality   quality;
+    Colors    colors;
+    Glyphs    glyphs;
+    int       hovered;
+    IVec2     resolution;
+    Vec2      char_size;
+} FrameInputs;
+
+static FrameInputs frame_inputs(const t_gamestate* gamestate, IVec2 resolution, Vec2 char_size)
+{
+    FrameInputs inputs;
+    memset(&inputs, 0, sizeof inputs); // padding too, inputs are compared with memcmp()
+    inputs.ball                 = gamestate->ball;
+    inputs.player1              = gamestate->player1;
+    inputs.player2              = gamestate->player2;
+    inputs.player               = gamestate->player;
+    inputs.menu_state           = gamestate->menu_state;
+    inputs.selected_accelerator = gamestate->selected_accelerator;
+    inputs.renderer             = gamestate->renderer;
+    inputs.quality              = gamestate->quality;
+    inputs.colors               = gamestate->colors;
+    inputs.glyphs               = gamestate->glyphs;
+    inputs.hovered              = gamestate->hovered;
+    inputs.resolution           = resolution;
+    inputs.char_size            = char_size;
+    return inputs;
+}
+
+// Sleeps until gamestate has changed since it had seen changes, or IDLE_TIMEOUT
+static void wait_for_changes(t_gamestate* gamestate, uint64_t seen)
+{
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += IDLE_TIMEOUT;
+
+    pthread_mutex_lock(&gamestate->lock);
+    while (gamestate->changes == seen)
+        if (pthread_cond_timedwait(&gamestate->changed, &gamestate->lock, &timeout) == ETIMEDOUT)
+            break;
+    pthread_mutex_unlock(&gamestate->lock);
 }
 
+// ----------------------------------------------------------------------------
+// Dynamic resolution
+//
+// Large terminals have more pixels than the CPU can render in a frame, so fewer
+// are rendered and scaled up while encoding. Every RESOLUTION_BALANCE_FRAMES
+// frames the scale steps down if frames took longer than RENDER_FRAME_TIME, or
+// up if the next scale should still fit with RESOLUTION_HEADROOM to spare. Time
+// is about proportional to pixels, so scale squared. Pixels that are not
+// damaged keep their old scale until the refresh band of frame_damage() passes.
+
+#ifndef RENDER_FRAME_TIME // seconds to render and encode a frame
+#define RENDER_FRAME_TIME (RENDER_FPS > 0 ? 1./RENDER_FPS : 1./60.)
+#endif
+#define RESOLUTION_BALANCE_FRAMES 8
+#define RESOLUTION_HEADROOM       .8
+
+static const Scalar resolution_scales[] = { 1.f, .75f, .5f, .375f, .25f };
+
+typedef struct dynamic_resolution
+{
+    size_t scale;   // index to resolution_scales
+    double seconds; // since the last update
+    int    frames;  // negative to skip frames after a change
+} DynamicResolution;
+
+static IVec2 scaled_resolution(const DynamicResolution* dynamic, IVec2 resolution)
+{
+    Scalar scale = resolution_scales[dynamic->scale];
+    return (IVec2){ fmax(1., resolution.x*scale + .5), fmax(1., resolution.y*scale + .5) };
+}
+
+static void dynamic_resolution_update(DynamicResolution* dynamic, double seconds)
+{
+    if (dynamic->frames++ < 0) // court cache is rebuilt after a change
+        return;
+    dynamic->seconds += seconds;
+    if (dynamic->frames < RESOLUTION_BALANCE_FRAMES)
+        return;
+
+    size_t scales_length = sizeof resolution_scales/sizeof resolution_scales[0];
+    double frame_time    = dynamic->seconds/dynamic->frames;
+    size_t scale         = dynamic->scale;
+    if (frame_time > RENDER_FRAME_TIME && scale + 1 < scales_length)
+        scale++;
+    else if (scale > 0) {
+        double larger = resolution_scales[scale - 1]/resolution_scales[scale];
+        if (frame_time*larger*larger < RESOLUTION_HEADROOM*RENDER_FRAME_TIME)
+            scale--;
+    }
+    *dynamic = (DynamicResolution){ .scale = scale, .frames = scale == dynamic->scale ? 0 : -1 };
+}
+
+typedef struct upscale_pass
+{
+    const RGBA8* colors;
+    IVec2        from;
+    IVec2        to;
+    int          cell_height;
+} UpscalePass;
+
+static void upscale_and_draw_row(int row, void* param)
+{
+    const UpscalePass* pass = param;
+    RGBA8 colors[pass->cell_height*pass->to.x];
+    for (int i = 0; i < pass->cell_height; ++i)
+    {
+        const RGBA8* from = &pass->colors[(pass->cell_height*row + i)*pass->from.y/pass->to.y*pass->from.x];
+        for (int x = 0; x < pass->to.x; ++x)
+            colors[i*pass->to.x + x] = from[x*pass->from.x/pass->to.x];
+    }
+    tengi_draw_row(row, colors);
+}
+
+// Same as render_and_draw(), but renders scaled_resolution pixels to scaled_colors
+// and scales them up to resolution when encoding. uniforms are for
+// scaled_resolution, damage is for resolution.
+static void render_and_draw_scaled(
+    TilePool*       pool,
+    RGBA8           scaled_colors[],
+    IVec2           scaled_resolution,
+    IVec2           resolution,
+    const Uniforms* uniforms,
+    const char      text[],
+    const IRect     damage[],
+    size_t          damage_length)
+{
+    IRect everything = { 0, 0, resolution.x, resolution.y };
+    if (tengi_draw_begin(resolution, damage, damage_length)) {
+        damage        = &everything;
+        damage_length = 1;
+    }
+    // Upscaled pixels of damage sample scaled pixels of scaled_damage
+    IRect scaled_damage[DAMAGE_RECTS_MAX];
+    for (size_t i = 0; i < damage_length; ++i)
+        scaled_damage[i] = (IRect){
+            .x0 = damage[i].x0*scaled_resolution.x/resolution.x,
+            .y0 = damage[i].y0*scaled_resolution.y/resolution.y,
+            .x1 = fmin(((damage[i].x1 - 1)*scaled_resolution.x/resolution.x) + 1, scaled_resolution.x),
+            .y1 = fmin(((damage[i].y1 - 1)*scaled_resolution.y/resolution.y) + 1, scaled_resolution.y),
+        };
+    fill_render_buffer(pool, scaled_colors, scaled_resolution, uniforms, scaled_damage, damage_length);
+
+    int cell_height = tengi_get_cell_pixels().y;
+    int rows[resolution.y/cell_height];
+    for (int row = 0; row < resolution.y/cell_height; ++row)
+        rows[row] = row;
+    UpscalePass upscale = { scaled_colors, scaled_resolution, resolution, cell_height };
+    tile_pool_run(pool, rows, resolution.y/cell_height, upscale_and_draw_row, &upscale, NULL);
+    tengi_draw_end(text);
+}
+
+// Frames rendered on an OpenCL device but not drawn yet. The device renders the
+// next ones while the last one is encoded, which improves throughput at the cost
+// of a frame of latency for each. 1 waits for every frame before drawing it.
+#ifndef OPENCL_FRAMES_IN_FLIGHT
+#define OPENCL_FRAMES_IN_FLIGHT 2
+#endif
+
+typedef struct opencl_frame
+{
+    cl_mem   out_buffer;
+    cl_mem   cells_buffer; // in host memory, mapped when done
+    cl_event mapped;       // NULL if not in flight
+    Cell*    cells;        // mapped cells_buffer, NULL if not mapped
+    IRect    damage[DAMAGE_RECTS_MAX];
+    size_t   damage_length;
+} OpenCLFrame;
+
 typedef struct opencl_context
 {
-    cl_mem           out_buffer;
+    OpenCLFrame      frames[OPENCL_FRAMES_IN_FLIGHT];
+    size_t           next_frame;
+    size_t           frames_in_flight;
+    size_t           global_work_size[2];
+    size_t           cells_work_size[2];
+    cl_int           cell_height; // pixels of cells, see tengi_get_cell_pixels()
     cl_kernel        kernel;
+    cl_kernel        cells_kernel;
     cl_program       program;
     cl_command_queue command_queue;
     cl_context       context;
 } OpenCLContext;
 
+// Waits for frames in flight and drops them
+static void finish_frames(OpenCLContext* cl)
+{
+    if (cl->command_queue != NULL)
+        clFinish(cl->command_queue);
+    for (size_t i = 0; i < OPENCL_FRAMES_IN_FLIGHT; ++i)
+    {
+        OpenCLFrame* frame = &cl->frames[i];
+        if (frame->mapped != NULL)
+            clReleaseEvent(frame->mapped);
+        if (frame->cells != NULL)
+            clEnqueueUnmapMemObject(cl->command_queue, frame->cells_buffer, frame->cells, 0, NULL, NULL);
+        frame->mapped = NULL;
+        frame->cells  = NULL;
+    }
+    if (cl->command_queue != NULL)
+        clFinish(cl->command_queue);
+    cl->next_frame       = 0;
+    cl->frames_in_flight = 0;
+}
+
+static void release_frames(OpenCLContext* cl)
+{
+    finish_frames(cl);
+    for (size_t i = 0; i < OPENCL_FRAMES_IN_FLIGHT; ++i) {
+        if (cl->frames[i].out_buffer != NULL)
+            clReleaseMemObject(cl->frames[i].out_buffer);
+        if (cl->frames[i].cells_buffer != NULL)
+            clReleaseMemObject(cl->frames[i].cells_buffer);
+    }
+    memset(cl->frames, 0, sizeof cl->frames);
+}
+
 static void release_context(OpenCLContext* cl)
 {
     if (cl == NULL)
         return;
-    if (cl->out_buffer != NULL)
-        clReleaseMemObject(cl->out_buffer);
+    release_frames(cl);
     if (cl->kernel != NULL)
         clReleaseKernel(cl->kernel);
+    if (cl->cells_kernel != NULL)
+        clReleaseKernel(cl->cells_kernel);
     if (cl->program != NULL)
         clReleaseProgram(cl->program);
     if (cl->command_queue != NULL)
@@ -135,99 +815,563 @@ static void release_context(OpenCLContext* cl)
     memset(cl, 0, sizeof*cl);
 }
 
-static OpenCLContext* fill_render_buffer_accelerated(
-    Vec4 colors[], IVec2 iresolution, cl_device_id device, t_gamestate gamestate)
+// Generated from src/frag.cl by make
+static const char program_source[] =
+    #include "frag.cl.h"
+    ;
+
+#define FNV1A_BASIS 0xcbf29ce484222325ull
+
+static unsigned long long fnv1a(unsigned long long hash, const void* data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ ((const unsigned char*)data)[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+// Device name and driver version, which compiled programs and their speed
+// depend on
+static unsigned long long hash_device(unsigned long long hash, cl_device_id device)
+{
+    char device_name[256]    = "";
+    char driver_version[256] = "";
+    clGetDeviceInfo(device, CL_DEVICE_NAME,    sizeof device_name,    device_name,    NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof driver_version, driver_version, NULL);
+    hash = fnv1a(hash, device_name,    strlen(device_name) + 1);
+    hash = fnv1a(hash, driver_version, strlen(driver_version) + 1);
+    return hash;
+}
+
+// Files are cached to $XDG_CACHE_HOME/clipong or ~/.cache/clipong, named by a
+// hash of what they depend on. Returns false if there's no cache directory.
+static bool cache_path(char path[static PATH_MAX], unsigned long long hash, const char extension[])
+{
+    const char* cache = getenv("XDG_CACHE_HOME");
+    const char* home  = getenv("HOME");
+    int length;
+    if (cache != NULL && cache[0] != '\0')
+        length = snprintf(path, PATH_MAX, "%s/clipong", cache);
+    else if (home != NULL && home[0] != '\0')
+        length = snprintf(path, PATH_MAX, "%s/.cache/clipong", home);
+    else
+        return false;
+    if (length < 0 || length >= PATH_MAX)
+        return false;
+    for (char* slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+    mkdir(path, 0755);
+    int name_length = snprintf(path + length, PATH_MAX - length, "/%016llx.%s", hash, extension);
+    return name_length > 0 && name_length < PATH_MAX - length;
+}
+
+static cl_program load_program_binary(cl_context context, cl_device_id device, const char path[])
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+    unsigned char* binary = NULL;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+        binary = malloc(size);
+    if (binary != NULL && fread(binary, 1, size, file) != (size_t)size) {
+        free(binary);
+        binary = NULL;
+    }
+    fclose(file);
+    if (binary == NULL)
+        return NULL;
+
+    cl_program program = clCreateProgramWithBinary(
+        context, 1, &device, &(size_t){size}, (const unsigned char**)&binary, NULL, NULL);
+    free(binary);
+    if (program != NULL && clBuildProgram(program, 1, &device, "", NULL, NULL) != CL_SUCCESS) {
+        clReleaseProgram(program);
+        program = NULL;
+    }
+    return program;
+}
+
+static void save_program_binary(cl_program program, const char path[])
+{
+    size_t size = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof size, &size, NULL) != CL_SUCCESS || size == 0)
+        return;
+    unsigned char* binary = malloc(size);
+    if (binary == NULL)
+        return;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof binary, &binary, NULL) == CL_SUCCESS)
+    {
+        FILE* file = fopen(path, "wb");
+        if (file != NULL) {
+            bool written = fwrite(binary, 1, size, file) == size;
+            if (fclose(file) != 0 || ! written)
+                remove(path);
+        }
+    }
+    free(binary);
+}
+
+// From the cache if possible, otherwise from source. NULL on failure, after
+// logging why if the source didn't build, so a device that can't run frag.cl is
+// only left out.
+static cl_program build_program(cl_context context, cl_device_id device)
+{
+    char path[PATH_MAX];
+    bool cached = cache_path(
+        path, fnv1a(hash_device(FNV1A_BASIS, device), program_source, sizeof program_source), "bin");
+
+    cl_program program = cached ? load_program_binary(context, device, path) : NULL;
+    if (program != NULL)
+        return program;
+
+    program = clCreateProgramWithSource(context, 1, &(const char*){program_source}, NULL, NULL);
+    if (program == NULL)
+        return NULL;
+    if (clBuildProgram(program, 1, &device, "", NULL, NULL) != CL_SUCCESS) {
+        char diagnostics[256] = "";
+        size_t diagnostics_length = 0;
+        clGetProgramBuildInfo(
+            program, device, CL_PROGRAM_BUILD_LOG, sizeof diagnostics, diagnostics, &diagnostics_length);
+        fprintf(stderr, "OpenCL program build failed: %s\n", diagnostics);
+        clReleaseProgram(program);
+        return NULL;
+    }
+    if (cached)
+        save_program_binary(program, path);
+    return program;
+}
+
+// (Re)initializes the context if device changed, and only the frame buffers if
+// iresolution or cells changed. NULL on failure.
+static OpenCLContext* opencl_context(cl_device_id device, IVec2 iresolution)
 {
     static cl_device_id last_device;
     static IVec2 last_resolution;
     static OpenCLContext cl;
-    static char program_source[8192];
-    static size_t global_work_size[2];
 
-    if (device != last_device || iresolution.x != last_resolution.x || iresolution.y != last_resolution.y)
-    { // (re)init
+    IVec2 cell = tengi_get_cell_pixels();
+
+    if (cl.context == NULL || device != last_device)
+    {
         release_context(&cl);
 
         cl.context = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
         if (cl.context == NULL)
             return release_context(&cl), NULL;
 
-        cl.command_queue = clCreateCommandQueueWithProperties(cl.context, device, NULL, NULL);
+        cl.command_queue = clCreateCommandQueueWithProperties( // profiling times hybrid frames
+            cl.context, device, (cl_queue_properties[]){ CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 }, NULL);
         if (cl.command_queue == NULL)
             return release_context(&cl), NULL;
 
-        if (program_source[0] == '\0') {
-            FILE* program_source_file = fopen("./src/frag.cl", "r");
-            assert(program_source_file != NULL);
-            size_t program_source_length = fread(program_source, 1, sizeof program_source, program_source_file);
-            assert(program_source_length != 0);
-            assert(program_source_length < sizeof program_source - sizeof"");
-            program_source[program_source_length] = '\0';
-            fclose(program_source_file);
-        }
-        cl.program = clCreateProgramWithSource(cl.context, 1, &(const char*){program_source}, NULL, NULL);
+        cl.program = build_program(cl.context, device);
         if (cl.program == NULL)
             return release_context(&cl), NULL;
-        if (clBuildProgram(cl.program, 1, &device, "", NULL, NULL) != CL_SUCCESS) {
-            char diagnostics[256] = "";
-            size_t diagnostics_length = 0;
-            clGetProgramBuildInfo(
-                cl.program, device, CL_PROGRAM_BUILD_LOG, sizeof diagnostics, diagnostics, &diagnostics_length);
-            fprintf(stderr, "OpenCL program build failed: %s\n", diagnostics);
-            exit(EXIT_FAILURE);
-        }
-
-        cl.out_buffer = clCreateBuffer(
-            cl.context, CL_MEM_WRITE_ONLY, iresolution.x*iresolution.y*sizeof colors[0], NULL, NULL);
-        if (cl.out_buffer == NULL)
-            return release_context(&cl), NULL;
 
         cl.kernel = clCreateKernel(cl.program, "main_image", NULL);
         if (cl.kernel == NULL)
             return release_context(&cl), NULL;
 
-        if (clSetKernelArg(cl.kernel, 0, sizeof(cl_mem), &cl.out_buffer) != CL_SUCCESS)
+        cl.cells_kernel = clCreateKernel(cl.program, "make_cells", NULL);
+        if (cl.cells_kernel == NULL)
             return release_context(&cl), NULL;
 
-        global_work_size[0] = iresolution.x;
-        global_work_size[1] = iresolution.y;
+        last_device = device;
+    }
+
+    if (cl.frames[0].out_buffer == NULL || iresolution.x != last_resolution.x || iresolution.y != last_resolution.y
+        || cell.y != cl.cell_height)
+    {
+        release_frames(&cl);
+
+        cl.global_work_size[0] = iresolution.x;
+        cl.global_work_size[1] = iresolution.y;
+        cl.cells_work_size[0]  = iresolution.x/cell.x;
+        cl.cells_work_size[1]  = iresolution.y/cell.y;
+        cl.cell_height         = cell.y;
 
+        for (size_t i = 0; i < OPENCL_FRAMES_IN_FLIGHT; ++i)
+        {
+            cl.frames[i].out_buffer = clCreateBuffer(
+                cl.context, CL_MEM_READ_WRITE, iresolution.x*iresolution.y*sizeof(RGBA8), NULL, NULL);
+            if (cl.frames[i].out_buffer == NULL)
+                return release_context(&cl), NULL;
+
+            cl.frames[i].cells_buffer = clCreateBuffer(
+                cl.context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+                cl.cells_work_size[0]*cl.cells_work_size[1]*sizeof(Cell), NULL, NULL);
+            if (cl.frames[i].cells_buffer == NULL)
+                return release_context(&cl), NULL;
+        }
         last_resolution = iresolution;
-        last_device     = device;
-    } // end init
+    }
+    return &cl;
+}
 
+// Renders pixel rows [0, rows) of the frame
+static bool enqueue_main_image(OpenCLContext* cl, cl_mem out_buffer, t_gamestate gamestate, int rows)
+{
     cl_float3 ball       = {.x = gamestate.ball.x,    .y = gamestate.ball.y, .z = gamestate.ball.z };
     cl_float2 player1    = {.x = gamestate.player1.x, .y = gamestate.player1.y };
     cl_float2 player2    = {.x = gamestate.player2.x, .y = gamestate.player2.y };
-    Vec2 char_size       = tengi_estimate_cell_size();
-    cl_float char_height = char_size.y/char_size.x;
+    cl_float char_height = pixel_height(tengi_estimate_cell_size());
     cl_int player        = gamestate.player;
+    cl_uint2 resolution  = {.x = cl->global_work_size[0], .y = cl->global_work_size[1] };
+
+    if (clSetKernelArg(cl->kernel, 0, sizeof out_buffer,  &out_buffer)  != CL_SUCCESS ||
+        clSetKernelArg(cl->kernel, 1, sizeof ball,        &ball)        != CL_SUCCESS ||
+        clSetKernelArg(cl->kernel, 2, sizeof player1,     &player1)     != CL_SUCCESS ||
+        clSetKernelArg(cl->kernel, 3, sizeof player2,     &player2)     != CL_SUCCESS ||
+        clSetKernelArg(cl->kernel, 4, sizeof char_height, &char_height) != CL_SUCCESS ||
+        clSetKernelArg(cl->kernel, 5, sizeof player,      &player)      != CL_SUCCESS ||
+        clSetKernelArg(cl->kernel, 6, sizeof resolution,  &resolution)  != CL_SUCCESS  )
+        return false;
+
+    return clEnqueueNDRangeKernel(
+        cl->command_queue, cl->kernel, 2, NULL, (size_t[]){ cl->global_work_size[0], rows }, NULL, 0, NULL, NULL)
+        == CL_SUCCESS;
+}
 
-    if (clSetKernelArg(cl.kernel, 1, sizeof ball,        &ball)        != CL_SUCCESS ||
-        clSetKernelArg(cl.kernel, 2, sizeof player1,     &player1)     != CL_SUCCESS ||
-        clSetKernelArg(cl.kernel, 3, sizeof player2,     &player2)     != CL_SUCCESS ||
-        clSetKernelArg(cl.kernel, 4, sizeof char_height, &char_height) != CL_SUCCESS ||
-        clSetKernelArg(cl.kernel, 5, sizeof player,      &player)      != CL_SUCCESS  )
-        return release_context(&cl), NULL;
+// Submits pixel rows [0, rows) of a frame to be rendered and split to cells on
+// the device without waiting. NULL on failure.
+static OpenCLFrame* submit_frame(OpenCLContext* cl, t_gamestate gamestate, int rows)
+{
+    OpenCLFrame* frame = &cl->frames[cl->next_frame];
+    if (frame->cells != NULL) // drawn last time
+        if (clEnqueueUnmapMemObject(cl->command_queue, frame->cells_buffer, frame->cells, 0, NULL, NULL)
+            != CL_SUCCESS)
+            return NULL;
+    frame->cells = NULL;
+
+    if ( ! enqueue_main_image(cl, frame->out_buffer, gamestate, rows))
+        return NULL;
+
+    if (clSetKernelArg(cl->cells_kernel, 0, sizeof(cl_mem), &frame->out_buffer)   != CL_SUCCESS ||
+        clSetKernelArg(cl->cells_kernel, 1, sizeof(cl_mem), &frame->cells_buffer) != CL_SUCCESS ||
+        clSetKernelArg(cl->cells_kernel, 2, sizeof(cl_int), &cl->cell_height)     != CL_SUCCESS  )
+        return NULL;
 
+    size_t cells_work_size[2] = { cl->cells_work_size[0], rows/cl->cell_height };
     if (clEnqueueNDRangeKernel(
-            cl.command_queue, cl.kernel, 2, NULL, global_work_size, NULL, 0, NULL, NULL)
+            cl->command_queue, cl->cells_kernel, 2, NULL, cells_work_size, NULL, 0, NULL, NULL)
         != CL_SUCCESS)
-        return release_context(&cl), NULL;
-
-    if (clEnqueueReadBuffer(
-            cl.command_queue,
-            cl.out_buffer,
-            CL_TRUE, 0,
-            iresolution.x*iresolution.y*sizeof colors[0],
-            colors, 0, NULL, NULL)
-        != CL_SUCCESS)
-        return release_context(&cl), NULL;
+        return NULL;
 
-    if (clFinish(cl.command_queue) != CL_SUCCESS)
-        return release_context(&cl), NULL;
+    cl_int error = CL_SUCCESS;
+    frame->cells = clEnqueueMapBuffer(
+        cl->command_queue, frame->cells_buffer, CL_FALSE, CL_MAP_READ, 0,
+        cells_work_size[0]*cells_work_size[1]*sizeof frame->cells[0],
+        0, NULL, &frame->mapped, &error);
+    if (error != CL_SUCCESS)
+        return NULL;
+    if (clFlush(cl->command_queue) != CL_SUCCESS)
+        return NULL;
 
-    return &cl;
+    cl->next_frame = (cl->next_frame + 1) % OPENCL_FRAMES_IN_FLIGHT;
+    cl->frames_in_flight++;
+    return frame;
+}
+
+// Waits until cells of frame are mapped. If seconds is not NULL, sets it to how
+// long the device took since the frame was submitted.
+static bool wait_frame(OpenCLContext* cl, OpenCLFrame* frame, double* seconds)
+{
+    if (clWaitForEvents(1, &frame->mapped) != CL_SUCCESS)
+        return false;
+    cl_ulong queued = 0;
+    cl_ulong end    = 0;
+    if (seconds != NULL
+        && (clGetEventProfilingInfo(frame->mapped, CL_PROFILING_COMMAND_QUEUED, sizeof queued, &queued, NULL)
+            != CL_SUCCESS
+        ||  clGetEventProfilingInfo(frame->mapped, CL_PROFILING_COMMAND_END,    sizeof end,    &end,    NULL)
+            != CL_SUCCESS))
+        return false;
+    if (seconds != NULL)
+        *seconds = 1e-9*(end - queued);
+    clReleaseEvent(frame->mapped);
+    frame->mapped = NULL;
+    cl->frames_in_flight--;
+    return true;
+}
+
+// Submits a frame to be rendered and split to cells on the device. Once
+// OPENCL_FRAMES_IN_FLIGHT frames are in flight, waits for the oldest one and
+// sets done to it, NULL before that. Its cells and damage are valid until the
+// next call. damage is drawn with the frame, not the current one.
+static OpenCLContext* render_cells_accelerated(
+    const OpenCLFrame** done,
+    IVec2               iresolution,
+    cl_device_id        device,
+    t_gamestate         gamestate,
+    const IRect         damage[],
+    size_t              damage_length)
+{
+    *done = NULL;
+    OpenCLContext* cl = opencl_context(device, iresolution);
+    if (cl == NULL)
+        return NULL;
+
+    OpenCLFrame* frame = submit_frame(cl, gamestate, iresolution.y);
+    if (frame == NULL)
+        return release_context(cl), NULL;
+    memcpy(frame->damage, damage, damage_length*sizeof damage[0]);
+    frame->damage_length = damage_length;
+
+    if (cl->frames_in_flight < OPENCL_FRAMES_IN_FLIGHT)
+        return cl;
+
+    OpenCLFrame* oldest = &cl->frames[cl->next_frame];
+    if ( ! wait_frame(cl, oldest, NULL))
+        return release_context(cl), NULL;
+    *done = oldest;
+    return cl;
+}
+
+// ----------------------------------------------------------------------------
+// Hybrid Rendering
+//
+// An OpenCL device renders the top rows of a frame while the CPU renders the
+// rest. Rows are split by how many each renders per second, measured every frame
+// and rebalanced every HYBRID_BALANCE_FRAMES frames, since the ball and paddles
+// moving in and out of the damage make CPU rows cheaper or pricier. Frames the
+// CPU or the device renders alone are measured too, and the last frame before
+// each rebalance gives the other a cell row, so it can win rows back.
+
+#define HYBRID_BALANCE_FRAMES 8
+
+typedef struct hybrid_split
+{
+    cl_device_id device;
+    double       device_share; // of pixel rows, from the top
+    double       cpu_seconds;  // since the last rebalance
+    double       device_seconds;
+    long         cpu_rows;
+    long         device_rows;
+    int          frames;
+} HybridSplit;
+
+// Frame times are e.g. from autotune(). Rows take about the same time on each,
+// so they are split inversely proportional to them.
+static HybridSplit hybrid_split_init(cl_device_id device, double cpu_frame_time, double device_frame_time)
+{
+    HybridSplit split = { .device = device, .device_share = .5 };
+    if (cpu_frame_time > 0. && device_frame_time > 0. && isfinite(cpu_frame_time))
+        split.device_share = cpu_frame_time/(cpu_frame_time + device_frame_time);
+    return split;
+}
+
+// Pixel rows rendered on the device, whole terminal rows so cells aren't split
+static int hybrid_device_rows(const HybridSplit* split, IVec2 resolution)
+{
+    int cell_height = tengi_get_cell_pixels().y;
+    int cell_rows   = resolution.y/cell_height;
+    int device_rows = (int)(split->device_share*cell_rows + .5);
+    if (split->frames == HYBRID_BALANCE_FRAMES - 1 && cell_rows > 1)
+        device_rows = fmin(fmax(device_rows, 1), cell_rows - 1);
+    return device_rows*cell_height;
+}
+
+static void hybrid_split_update(
+    HybridSplit* split, int device_rows, double device_seconds, int cpu_rows, double cpu_seconds)
+{
+    split->device_rows    += device_rows;
+    split->device_seconds += device_seconds;
+    split->cpu_rows       += cpu_rows;
+    split->cpu_seconds    += cpu_seconds;
+    if (++split->frames < HYBRID_BALANCE_FRAMES)
+        return;
+
+    if (split->device_seconds > 0. && split->cpu_seconds > 0.) {
+        double device_speed = split->device_rows/split->device_seconds;
+        double cpu_speed    = split->cpu_rows/split->cpu_seconds;
+        split->device_share = device_speed/(device_speed + cpu_speed);
+    }
+    *split = (HybridSplit){ .device = split->device, .device_share = split->device_share };
+}
+
+typedef struct cells_pass
+{
+    const Cell* cells;
+    size_t      columns; // of cells_buffer, see OpenCLContext.cells_work_size
+} CellsPass;
+
+static void draw_cells_row(int row, void* param)
+{
+    const CellsPass* pass = param;
+    tengi_draw_row_cells(row, &pass->cells[row*pass->columns]);
+}
+
+// Same as render_and_draw(), but the device of split renders the top rows at
+// the same time. Frames in flight are dropped, so everything should be redrawn
+// when switching from render_cells_accelerated(). NULL on OpenCL failure.
+static OpenCLContext* render_and_draw_hybrid(
+    TilePool*       pool,
+    RGBA8           colors[],
+    IVec2           resolution,
+    const Uniforms* uniforms,
+    const char      text[],
+    t_gamestate     gamestate,
+    const IRect     damage[],
+    size_t          damage_length,
+    HybridSplit*    split)
+{
+    OpenCLContext* cl = opencl_context(split->device, resolution);
+    if (cl == NULL)
+        return NULL;
+    if (cl->frames_in_flight > 0)
+        finish_frames(cl);
+
+    int device_rows = hybrid_device_rows(split, resolution);
+    OpenCLFrame* frame = submit_frame(cl, gamestate, device_rows);
+    if (frame == NULL)
+        return release_context(cl), NULL;
+
+    IRect everything = { 0, 0, resolution.x, resolution.y };
+    if (tengi_draw_begin(resolution, damage, damage_length)) {
+        damage        = &everything;
+        damage_length = 1;
+    }
+    RenderPass pass = render_pass_init(pool, resolution, uniforms, damage, damage_length, device_rows);
+
+    double start = tengi_time();
+    render_tiles(colors, &pass, device_rows, resolution.y, true);
+    double cpu_seconds = tengi_time() - start;
+
+    double device_seconds;
+    if ( ! wait_frame(cl, frame, &device_seconds))
+        return release_context(cl), NULL;
+
+    int rows[device_rows/cl->cell_height];
+    for (int row = 0; row < device_rows/cl->cell_height; ++row)
+        rows[row] = row;
+    CellsPass cells_pass = { frame->cells, cl->cells_work_size[0] };
+    tile_pool_run(pool, rows, device_rows/cl->cell_height, draw_cells_row, &cells_pass, NULL);
+    tengi_draw_end(text);
+
+    hybrid_split_update(split, device_rows, device_seconds, resolution.y - device_rows, cpu_seconds);
+    return cl;
+}
+
+// Which backend renders a frame
+typedef enum frame_path
+{
+    PATH_CPU,
+    PATH_HYBRID, // see render_and_draw_hybrid()
+    PATH_DEVICE, // see render_cells_accelerated()
+} FramePath;
+
+// ----------------------------------------------------------------------------
+// Autotuning
+//
+// The fastest backend depends on the machine, the terminal size and what's
+// installed, so they are all timed on the first frame and the fastest one is
+// selected. Backend 0 is the CPU, others are OpenCL devices[backend - 1].
+
+#define BENCHMARK_FRAMES 8
+
+// Milliseconds per frame at resolution. INFINITY if the backend failed.
+static double benchmark_backend(
+    TilePool*          pool,
+    size_t             backend,
+    const cl_device_id devices[],
+    IVec2              resolution,
+    Scalar             char_height,
+    Renderer           renderer)
+{
+    t_gamestate gamestate = { .player = PLAYER1, .renderer = renderer };
+    IRect       everything = { 0, 0, resolution.x, resolution.y };
+    RGBA8*      colors     = NULL;
+    if (backend == 0 && (colors = malloc(sizeof colors[0] * resolution.x*resolution.y)) == NULL)
+        return INFINITY;
+
+    OpenCLContext* cl    = NULL;
+    double         start = 0.;
+    for (int frame = -1; frame < BENCHMARK_FRAMES; ++frame) // first one is warmup
+    {
+        if (frame == 0)
+            start = tengi_time();
+        gamestate.ball.x = .5*sin(frame);
+        gamestate.ball.z = 2.*cos(frame);
+        gamestate.player1.x = gamestate.ball.x;
+        gamestate.player2.y = gamestate.ball.x;
+        if (backend == 0) {
+            Uniforms uniforms;
+            uniforms_init(&uniforms, &gamestate, vec2(resolution.x, resolution.y), char_height, frame);
+            fill_render_buffer(pool, colors, resolution, &uniforms, &everything, 1);
+            continue;
+        }
+        const OpenCLFrame* done;
+        cl = render_cells_accelerated(&done, resolution, devices[backend - 1], gamestate, &everything, 1);
+        if (cl == NULL)
+            return INFINITY;
+    }
+    if (cl != NULL)
+        finish_frames(cl); // frames in flight are part of the time
+    double frame_time = 1000.*(tengi_time() - start)/BENCHMARK_FRAMES;
+    release_context(cl);
+    free(colors);
+    return frame_time;
+}
+
+// Times every backend or reads the times from the cache if nothing changed.
+// Returns the fastest backend.
+static size_t autotune(
+    TilePool*          pool,
+    double             frame_times[],
+    const cl_device_id devices[],
+    size_t             devices_length,
+    IVec2              resolution,
+    Scalar             char_height,
+    Renderer           renderer)
+{
+    unsigned long long hash = FNV1A_BASIS;
+    for (size_t i = 0; i < devices_length; ++i)
+        hash = hash_device(hash, devices[i]);
+    hash = fnv1a(hash, &resolution,    sizeof resolution);
+    hash = fnv1a(hash, &renderer,      sizeof renderer);
+    hash = fnv1a(hash, program_source, sizeof program_source);
+
+    char path[PATH_MAX];
+    bool   cached        = cache_path(path, hash, "txt");
+    FILE*  file          = cached ? fopen(path, "r") : NULL;
+    size_t backends_read = 0;
+    while (file != NULL && backends_read < devices_length + 1
+        && fscanf(file, "%lf", &frame_times[backends_read]) == 1)
+        ++backends_read;
+    if (file != NULL)
+        fclose(file);
+
+    if (backends_read != devices_length + 1)
+    {
+        for (size_t i = 0; i < devices_length + 1; ++i)
+            frame_times[i] = benchmark_backend(pool, i, devices, resolution, char_height, renderer);
+        if (cached && (file = fopen(path, "w")) != NULL) {
+            for (size_t i = 0; i < devices_length + 1; ++i)
+                fprintf(file, "%f\n", frame_times[i]);
+            fclose(file);
+        }
+    }
+
+    size_t fastest = 0;
+    for (size_t i = 1; i < devices_length + 1; ++i)
+        fastest = frame_times[i] < frame_times[fastest] ? i : fastest;
+    return fastest;
+}
+
+// Label of a backend in MENU_SELECT_ACCELERATOR with its time per frame
+static void accelerator_item(
+    char out[static MENU_SELECT_ACCELERATOR_LENGTH + 1], const char name[], double frame_time)
+{
+    int name_length = MENU_SELECT_ACCELERATOR_LENGTH - sizeof" 1234.5 ms" + 1;
+    if (isinf(frame_time))
+        sprintf(out, "%-*.*s%*s", name_length, name_length, name, (int)sizeof" 1234.5 ms" - 1, "failed");
+    else if (frame_time > 0.)
+        sprintf(out, "%-*.*s %6.1f ms", name_length, name_length, name, fmin(frame_time, 9999.9));
+    else
+        sprintf(out, "%-.*s", MENU_SELECT_ACCELERATOR_LENGTH, name);
 }
 
 void *rendering_loop(void *void_gamestate_ptr)
@@ -275,7 +1419,21 @@ void *rendering_loop(void *void_gamestate_ptr)
     }
     char text[1024] = "";
 
+    double         frame_times[1 + sizeof devices/sizeof devices[0]] = {0};
+    bool           autotuned = false;
+    HybridSplit    split     = {0};
+    FramePath      last_path = PATH_CPU;
     OpenCLContext* opencl = NULL;
+    RGBA8*         colors = NULL;
+    IVec2          colors_resolution = {0};
+    DynamicResolution dynamic_resolution = {0};
+    FramePacer     pacer = { .deadline = monotonic_seconds() };
+    RGBA8*         scaled_colors = NULL;
+    IVec2          scaled_colors_resolution = {0};
+    FrameInputs    last_inputs = {0};
+    int            unchanged_frames = 0;
+    TilePool*      pool = tile_pool_create(RENDER_THREADS, RENDER_PIN_THREADS);
+    assert(pool != NULL);
 	g_gamestate_ptr = (t_gamestate*)void_gamestate_ptr;
     g_gamestate_ptr->resize_timer = 100; // don't wait initially
 
@@ -283,14 +1441,35 @@ void *rendering_loop(void *void_gamestate_ptr)
     {
         IVec2 resolution;
 
+        frame_pacer_wait(&pacer);
+
         pthread_mutex_lock(&g_gamestate_ptr->lock);
         t_gamestate gamestate = *g_gamestate_ptr;
         g_gamestate_ptr->resize_timer++;;
+        g_gamestate_ptr->frame_stats = pacer.stats;
         pthread_mutex_unlock(&g_gamestate_ptr->lock);
 
         if (gamestate.exit_thread == true)
             break;
 
+        static const struct { OutputColors colors; bool dither; } output_colors[COLORS_LENGTH] = {
+            [COLORS_ADAPTIVE]     = { OUTPUT_COLORS_ADAPTIVE, true  },
+            [COLORS_24BIT]        = { OUTPUT_COLORS_24BIT,    false },
+            [COLORS_256]          = { OUTPUT_COLORS_256,      false },
+            [COLORS_256_DITHERED] = { OUTPUT_COLORS_256,      true  },
+            [COLORS_16]           = { OUTPUT_COLORS_16,       false },
+            [COLORS_16_DITHERED]  = { OUTPUT_COLORS_16,       true  },
+        };
+        tengi_set_output_colors(
+            output_colors[gamestate.colors].colors, output_colors[gamestate.colors].dither);
+
+        static const CellGlyphs cell_glyphs[GLYPHS_LENGTH] = {
+            [GLYPHS_QUADRANTS] = CELL_GLYPHS_QUADRANTS,
+            [GLYPHS_SEXTANTS]  = CELL_GLYPHS_SEXTANTS,
+            [GLYPHS_BRAILLE]   = CELL_GLYPHS_BRAILLE,
+        };
+        tengi_set_cell_glyphs(cell_glyphs[gamestate.glyphs]);
+
         size_t device_index = gamestate.selected_accelerator;
         if (device_index >= devices_length)
             device_index = -1;
@@ -298,46 +1477,175 @@ void *rendering_loop(void *void_gamestate_ptr)
         if (device_index != (size_t)-1)
             device = devices[device_index];
 
-        if ( ! gamestate.game_running || gamestate.resize_timer <= 30)
+        if ( ! gamestate.game_running)
         {
+            unchanged_frames = 0;
+            tengi_draw_flush(); // before the menus are written
+            wait_for_changes(g_gamestate_ptr, gamestate.changes);
+            continue;
+        }
+        else if (gamestate.resize_timer <= 30)
+        {
+            unchanged_frames = 0;
             usleep(1000*1000/60);
             continue;
         }
         else
         {
             resolution = tengi_get_terminal_resolution();
+            Vec2 char_size = tengi_estimate_cell_size();
+            if (char_size.x == 0.f) {
+                fprintf(stderr, "Character cell size is 0!\n");
+                usleep(1000*1000/60);
+                continue;
+            }
+
+            if ( ! autotuned) {
+                size_t fastest = autotune(
+                    pool, frame_times, devices, devices_length, resolution, pixel_height(char_size), gamestate.renderer);
+                pthread_mutex_lock(&g_gamestate_ptr->lock);
+                g_gamestate_ptr->selected_accelerator = fastest - 1;
+                pthread_mutex_unlock(&g_gamestate_ptr->lock);
+                autotuned = true;
+                continue;
+            }
 
-            Vec4* colors = malloc(sizeof(Vec4) * resolution.x*resolution.y);
+            FrameInputs inputs = frame_inputs(&gamestate, resolution, char_size);
+            if (memcmp(&inputs, &last_inputs, sizeof inputs) != 0) {
+                last_inputs      = inputs;
+                unchanged_frames = 0;
+            } else if (unchanged_frames >= IDLE_SETTLE_FRAMES) {
+                wait_for_changes(g_gamestate_ptr, gamestate.changes);
+                continue;
+            }
+            unchanged_frames++;
 
-            if (device_index == (size_t)-1)
-    			fill_render_buffer(colors, resolution, gamestate);
-            else
-                assert(
-                    (opencl = fill_render_buffer_accelerated(
-                        colors, resolution, device, gamestate)
-                    ) != NULL);
+            if (device != NULL && device != split.device)
+                split = hybrid_split_init(device, frame_times[0], frame_times[device_index + 1]);
+            int       device_rows = device == NULL ? 0 : hybrid_device_rows(&split, resolution);
+            FramePath path        = device_rows == 0 ? PATH_CPU
+                : device_rows < resolution.y ? PATH_HYBRID : PATH_DEVICE;
 
-            tengi_draw(resolution, colors, text);
+            // Leaving the device path drops frames in flight, whose damage is
+            // never drawn. Rows the device rendered are damaged by frame_damage().
+            bool redraw = last_path == PATH_DEVICE && path != PATH_DEVICE;
+            if (redraw && opencl != NULL)
+                finish_frames(opencl);
+            last_path = path;
 
-			free(colors);
-		}
+            Uniforms uniforms;
+            uniforms_init(
+                &uniforms,
+                &gamestate,
+                vec2(resolution.x, resolution.y),
+                pixel_height(char_size),
+                tengi_time());
 
-        usleep(1000*1000/60);
+            IRect  damage[DAMAGE_RECTS_MAX];
+            size_t damage_length = frame_damage(
+                damage, &uniforms, path == PATH_DEVICE ? resolution.y : device_rows, redraw);
 
-        if (gamestate.menu_state == MENU_GAME_ROOT) {
-            if (gamestate.hovered == -1)
-                snprintf(text, sizeof text,
-                    FG_CYAN BG_BLACK "Select hardware accelerator" C_END "\n"
-                    FG_RED  BG_BLACK "Exit                       " C_END "\n");
-            else if (gamestate.hovered == 0)
-                snprintf(text, sizeof text,
-                    FG_BLACK BG_RED  "Select hardware accelerator" C_END "\n"
-                    FG_RED BG_BLACK  "Exit                       " C_END "\n");
+            if (resolution.x != colors_resolution.x || resolution.y != colors_resolution.y) {
+                free(colors);
+                colors = malloc(sizeof(RGBA8) * resolution.x*resolution.y);
+                colors_resolution = resolution;
+            }
+
+            IVec2 scaled      = scaled_resolution(&dynamic_resolution, resolution);
+            bool  scaled_down = scaled.x != resolution.x || scaled.y != resolution.y;
+            if (path == PATH_CPU)
+            {
+                double start = tengi_time();
+                if ( ! scaled_down)
+                    render_and_draw(pool, colors, resolution, &uniforms, text, damage, damage_length);
+                else
+                {
+                    if (scaled.x != scaled_colors_resolution.x || scaled.y != scaled_colors_resolution.y) {
+                        free(scaled_colors);
+                        scaled_colors = malloc(sizeof(RGBA8) * scaled.x*scaled.y);
+                        scaled_colors_resolution = scaled;
+                    }
+                    Uniforms scaled_uniforms;
+                    uniforms_init(
+                        &scaled_uniforms,
+                        &gamestate,
+                        vec2(scaled.x, scaled.y),
+                        pixel_height(char_size) * ((Scalar)scaled.x/resolution.x)/((Scalar)scaled.y/resolution.y),
+                        uniforms.time);
+                    render_and_draw_scaled(
+                        pool, scaled_colors, scaled, resolution, &scaled_uniforms, text, damage, damage_length);
+                }
+                double seconds = tengi_time() - start;
+                dynamic_resolution_update(&dynamic_resolution, seconds);
+                if (device != NULL) // in rows of resolution
+                    hybrid_split_update(&split, 0, 0., scaled.y*scaled.x/resolution.x, seconds);
+            }
+            else if (path == PATH_HYBRID)
+            {
+                opencl = render_and_draw_hybrid(
+                    pool, colors, resolution, &uniforms, text, gamestate, damage, damage_length, &split);
+                assert(opencl != NULL);
+            }
             else
-                snprintf(text, sizeof text,
-                    FG_CYAN BG_BLACK "Select hardware accelerator" C_END "\n"
-                    FG_BLACK BG_RED  "Exit                       " C_END "\n");
+            {
+                const OpenCLFrame* frame;
+                double start = tengi_time();
+                opencl = render_cells_accelerated(&frame, resolution, device, gamestate, damage, damage_length);
+                assert(opencl != NULL);
+                if (frame != NULL) { // waited for frame as long as the device was slower
+                    hybrid_split_update(&split, resolution.y, tengi_time() - start, 0, 0.);
+                    tengi_draw_cells(resolution, frame->cells, text, frame->damage, frame->damage_length);
+                }
+            }
+            frame_pacer_done(&pacer);
+		}
+
+        if (gamestate.menu_state == MENU_GAME_ROOT) {
+            static const char* renderer_names[RENDERER_LENGTH] = {
+                [RENDERER_RAY_MARCHING]         = "Renderer: ray marching",
+                [RENDERER_RAY_MARCHING_PACKETS] = "Renderer: SIMD ray marching",
+                [RENDERER_RAY_TRACING]          = "Renderer: ray tracing",
+            };
+            static const char* quality_names[QUALITY_LENGTH] = {
+                [QUALITY_FULL]         = "Quality: full",
+                [QUALITY_CHECKERBOARD] = "Quality: checkerboard",
+            };
+            static const char* colors_names[COLORS_LENGTH] = {
+                [COLORS_ADAPTIVE]     = "Colors: adaptive",
+                [COLORS_24BIT]        = "Colors: 24-bit",
+                [COLORS_256]          = "Colors: 256",
+                [COLORS_256_DITHERED] = "Colors: 256, dithered",
+                [COLORS_16]           = "Colors: 16",
+                [COLORS_16_DITHERED]  = "Colors: 16, dithered",
+            };
+            static const char* glyphs_names[GLYPHS_LENGTH] = {
+                [GLYPHS_QUADRANTS] = "Glyphs: quadrants, 2x2",
+                [GLYPHS_SEXTANTS]  = "Glyphs: sextants, 2x3",
+                [GLYPHS_BRAILLE]   = "Glyphs: braille, 2x4",
+            };
+            const char* items[MENU_ROOT_LENGTH] = {
+                [MENU_ROOT_SELECT_ACCELERATOR] = "Select hardware accelerator",
+                [MENU_ROOT_RENDERER]           = renderer_names[gamestate.renderer],
+                [MENU_ROOT_QUALITY]            = quality_names[gamestate.quality],
+                [MENU_ROOT_COLORS]             = colors_names[gamestate.colors],
+                [MENU_ROOT_GLYPHS]             = glyphs_names[gamestate.glyphs],
+                [MENU_ROOT_EXIT]               = "Exit",
+            };
+            text[0] = '\0';
+            for (int i = 0; i < MENU_ROOT_LENGTH; ++i)
+            {
+                if (gamestate.hovered == i)
+                    strcat(text, FG_BLACK BG_RED);
+                else if (i == MENU_ROOT_EXIT)
+                    strcat(text, FG_RED BG_BLACK);
+                else
+                    strcat(text, FG_CYAN BG_BLACK);
+                sprintf(
+                    text + strlen(text), "%-*s" C_END "\n",
+                    MENU_GAME_ROOT_LENGTH, items[i]);
+            }
         } else {
+            char item[MENU_SELECT_ACCELERATOR_LENGTH + 1];
             text[0] = '\0';
             if (gamestate.hovered == 0)
                 strcat(text, FG_BLACK BG_RED);
@@ -345,15 +1653,17 @@ void *rendering_loop(void *void_gamestate_ptr)
                 strcat(text, "\e[48;2;122;122;122m");
             else
                 strcat(text, FG_CYAN BG_BLACK);
+            accelerator_item(item, "Default (CPU)", frame_times[0]);
             sprintf(
                 text + strlen(text), "%-*s" C_END "\n",
-                MENU_SELECT_ACCELERATOR_LENGTH, "Default (CPU)");
+                MENU_SELECT_ACCELERATOR_LENGTH, item);
 
             for (size_t i = 0; i < devices_length; ++i)
             {
-                char name[MENU_SELECT_ACCELERATOR_LENGTH];
+                char name[256] = "";
                 size_t name_length = 0;
                 clGetDeviceInfo(devices[i], CL_DEVICE_NAME, sizeof name, name, &name_length);
+                accelerator_item(item, name, frame_times[i + 1]);
                 if (gamestate.hovered - 1 == (int)i)
                     strcat(text, FG_BLACK BG_RED);
                 else if (i == device_index)
@@ -362,10 +1672,13 @@ void *rendering_loop(void *void_gamestate_ptr)
                     strcat(text, FG_CYAN BG_BLACK);
                 sprintf(
                     text + strlen(text), "%-*s" C_END "\n",
-                    MENU_SELECT_ACCELERATOR_LENGTH, name);
+                    MENU_SELECT_ACCELERATOR_LENGTH, item);
             }
         }
     }
+    free(colors);
+    free(scaled_colors);
+    tile_pool_destroy(pool);
     release_context(opencl);
     for (size_t i = 0; i < devices_length; ++i)
         clReleaseDevice(devices[i]);
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE // pthread_setaffinity_np()
+#include <tile_pool.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Tiles of a worker are dealt[begin, end). The owner takes them from the front
+// and thieves from the back, both with a CAS on the packed range, so taking a
+// tile never locks.
+typedef struct worker
+{
+    _Atomic uint64_t range; // begin << 32 | end
+    pthread_t        thread;
+    TilePool*        pool;
+    int              index;
+} Worker;
+
+struct tile_pool
+{
+    Worker*         workers; // workers[0] is the thread calling tile_pool_run()
+    int             workers_length;
+    int*            dealt;
+    int             dealt_capacity;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  start;
+    pthread_cond_t  done;
+    unsigned long   generation; // of the current run
+    int             running;    // workers still in the current run
+    bool            exiting;
+
+    void          (*task)(int tile, void* param);
+    void*           param;
+    float*          seconds;
+};
+
+static double seconds_now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + 1e-9*time.tv_nsec;
+}
+
+static bool take_tile(Worker* worker, bool steal, int* tile)
+{
+    uint64_t range = atomic_load(&worker->range);
+    while (true)
+    {
+        uint32_t begin = range >> 32;
+        uint32_t end   = (uint32_t)range;
+        if (begin >= end)
+            return false;
+        uint64_t taken = steal ? (uint64_t)begin << 32 | (end - 1) : (uint64_t)(begin + 1) << 32 | end;
+        if (atomic_compare_exchange_weak(&worker->range, &range, taken)) {
+            *tile = worker->pool->dealt[steal ? end - 1 : begin];
+            return true;
+        }
+    }
+}
+
+static void run_tile(TilePool* pool, int tile)
+{
+    if (pool->seconds == NULL) {
+        pool->task(tile, pool->param);
+        return;
+    }
+    double start = seconds_now();
+    pool->task(tile, pool->param);
+    pool->seconds[tile] = seconds_now() - start;
+}
+
+// Runs own tiles, then steals until every worker is out of tiles. Ranges only
+// shrink during a run, so one pass without finding any means all are taken.
+static void work(Worker* worker)
+{
+    TilePool* pool = worker->pool;
+    int       tile;
+    while (take_tile(worker, false, &tile))
+        run_tile(pool, tile);
+
+    for (bool stolen = true; stolen;) {
+        stolen = false;
+        for (int i = 1; i < pool->workers_length; ++i) {
+            Worker* victim = &pool->workers[(worker->index + i) % pool->workers_length];
+            while (take_tile(victim, true, &tile)) {
+                run_tile(pool, tile);
+                stolen = true;
+            }
+        }
+    }
+}
+
+static void* worker_main(void* param)
+{
+    Worker*       worker     = param;
+    TilePool*     pool       = worker->pool;
+    unsigned long generation = 0;
+    while (true)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == generation && ! pool->exiting)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        generation = pool->generation;
+        bool exiting = pool->exiting;
+        pthread_mutex_unlock(&pool->lock);
+        if (exiting)
+            return NULL;
+
+        work(worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+            pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void pin_thread(pthread_t thread, int core)
+{
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(core, &cores);
+    pthread_setaffinity_np(thread, sizeof cores, &cores);
+}
+
+TilePool* tile_pool_create(int threads, bool pin_threads)
+{
+    int cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cores     = cores > 0 ? cores : 1;
+    threads   = threads > 0 ? threads : cores;
+
+    TilePool* pool = calloc(1, sizeof*pool);
+    if (pool == NULL)
+        return NULL;
+    pool->workers = calloc(threads, sizeof pool->workers[0]);
+    if (pool->workers == NULL)
+        return free(pool), NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    pool->workers[0] = (Worker){ .thread = pthread_self(), .pool = pool, .index = 0 };
+    pool->workers_length = 1;
+    for (int i = 1; i < threads; ++i)
+    {
+        pool->workers[i] = (Worker){ .pool = pool, .index = i };
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0)
+            break; // fewer threads is fine
+        pool->workers_length++;
+    }
+    for (int i = 0; pin_threads && i < pool->workers_length; ++i)
+        pin_thread(pool->workers[i].thread, i % cores);
+    return pool;
+}
+
+void tile_pool_destroy(TilePool* pool)
+{
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->exiting = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->workers_length; ++i)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->dealt);
+    free(pool->workers);
+    free(pool);
+}
+
+void tile_pool_run(
+    TilePool*   pool,
+    const int   order[],
+    int         length,
+    void      (*task)(int tile, void* param),
+    void*       param,
+    float       seconds[])
+{
+    if (length > pool->dealt_capacity) {
+        int* dealt = realloc(pool->dealt, length*sizeof dealt[0]);
+        if (dealt == NULL) { // run everything on this thread
+            for (int i = 0; i < length; ++i)
+                task(order[i], param);
+            return;
+        }
+        pool->dealt          = dealt;
+        pool->dealt_capacity = length;
+    }
+
+    // Dealt like cards so every worker starts with the first tiles of order
+    int begin = 0;
+    for (int i = 0; i < pool->workers_length; ++i)
+    {
+        int end = begin;
+        for (int j = i; j < length; j += pool->workers_length)
+            pool->dealt[end++] = order[j];
+        atomic_store(&pool->workers[i].range, (uint64_t)begin << 32 | end);
+        begin = end;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task    = task;
+    pool->param   = param;
+    pool->seconds = seconds;
+    pool->running = pool->workers_length - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    work(&pool->workers[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -48,6 +48,32 @@ typedef struct s_IVec2
 	int y;
 } IVec2;
 
+typedef struct s_RGBA8 // gamma corrected, same layout as OpenCL uchar4
+{
+	unsigned char r;
+	unsigned char g;
+	unsigned char b;
+	unsigned char a;
+} RGBA8;
+
+// Terminal cell of 2 pixels wide and 2 to 4 high, see tengi_set_cell_glyphs().
+// Bits of glyph are pixels row by row from top left, set ones are drawn with fg
+// and others with bg.
+typedef struct s_Cell
+{
+	unsigned char glyph;
+	unsigned char fg[3];
+	unsigned char bg[3];
+} Cell;
+
+typedef struct s_IRect // x0 <= x < x1 and y0 <= y < y1
+{
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+} IRect;
+
 // Initialize engine. Auto destroyed at exit.
 void tengi_init(void);
 
@@ -57,7 +83,7 @@ IVec2 tengi_get_window_size(void);         // in pixels
 IVec2 tengi_get_display_size(void);        // in pixels
 IVec2 tengi_get_terminal_size(void);       // in characters
 IVec2 tengi_get_global_mouse_pos(void);    // in pixels
-IVec2 tengi_get_terminal_resolution(void); // in characters divided to 4 cells
+IVec2 tengi_get_terminal_resolution(void); // in pixels of cells, see tengi_set_cell_glyphs()
 
 // Estimate terminal attributes in pixels. Estimations are based on click data,
 // so mouse press handler has to be set. If any of these change, it might take a
@@ -89,8 +115,88 @@ void tengi_handle_events(void);
 
 double tengi_time(void); // in seconds since the first call
 
-// colors is user allocated buffer with size resolution.x*resolution.y
-void tengi_draw(IVec2 resolution, const Vec4 colors[], const char text[]);
+typedef struct s_DrawStats
+{
+    unsigned long long frames;
+    unsigned long long bytes_written;
+    unsigned long long bytes_saved; // compared to drawing full frames
+    unsigned long long frames_dropped; // a newer one was drawn before writing
+    double drain_rate; // bytes per second the terminal takes when it's the bottleneck, 0 if never
+} DrawStats;
+
+// Colors written to the terminal
+typedef enum e_OutputColors
+{
+    OUTPUT_COLORS_ADAPTIVE, // the best the terminal can take at the frame rate
+    OUTPUT_COLORS_24BIT,
+    OUTPUT_COLORS_256,      // xterm palette
+    OUTPUT_COLORS_16,       // ANSI, e.g. for the Linux console
+    OUTPUT_COLORS_LENGTH,
+} OutputColors;
+
+// Palette colors are dithered if dither. Cells are split less if the terminal
+// can't take them at the frame rate. Adaptive by default.
+void tengi_set_output_colors(OutputColors colors, bool dither);
+
+// Glyphs that split terminal cells to pixels
+typedef enum e_CellGlyphs
+{
+    CELL_GLYPHS_QUADRANTS, // 2x2 block elements, which every font has
+    CELL_GLYPHS_SEXTANTS,  // 2x3 block sextants of Unicode 13
+    CELL_GLYPHS_BRAILLE,   // 2x4 braille patterns, pixels are dots with gaps
+    CELL_GLYPHS_LENGTH,
+} CellGlyphs;
+
+// Resolutions drawn are in pixels of cells split by glyphs, which are
+// tengi_get_cell_pixels() large. Quadrants by default. Call between frames from
+// the thread that draws them.
+void  tengi_set_cell_glyphs(CellGlyphs glyphs);
+IVec2 tengi_get_cell_pixels(void);
+
+// colors is user allocated buffer with size resolution.x*resolution.y. text is
+// drawn over cells from the top left, a line per terminal row, and may be NULL.
+// Only cells overlapping dirty rects (in pixels) are redrawn, others are left as
+// they were. Of those and of text, only cells that changed since the last draw
+// are written, unless a full frame is shorter. If dirty is NULL, or the terminal
+// may not show the last draw, e.g. after resize, everything is redrawn.
+// Frames are encoded and written by a present thread after returning. If the
+// terminal is slower than drawing, only the newest frame is written, and at
+// most one waits to be written. Frames are written whole, and shown whole if
+// the terminal supports synchronized output.
+void tengi_draw(
+    IVec2       resolution,
+    const RGBA8 colors[],
+    const char  text[],
+    const IRect dirty[],
+    size_t      dirty_length);
+
+// Same as tengi_draw(), but colors can be rendered and split to cells row by
+// row in parallel. Call tengi_draw_row() for every terminal row between these.
+// Returns true if every cell has to be drawn, not just dirty ones.
+bool tengi_draw_begin(IVec2 resolution, const IRect dirty[], size_t dirty_length);
+void tengi_draw_end(const char text[]);
+
+// Waits until the last frame drawn is written, e.g. before writing to the
+// terminal without tengi.
+void tengi_draw_flush(void);
+
+// colors are the rows of pixels of a terminal row, tengi_get_cell_pixels().y of
+// them. Only pixels of dirty cells are read. Thread safe for different rows.
+void tengi_draw_row(int row, const RGBA8 colors[]);
+
+// Same as tengi_draw_row(), but colors are already split to cells of the row.
+void tengi_draw_row_cells(int row, const Cell cells[]);
+
+// Same as tengi_draw(), but colors are already split to cells, e.g. on a GPU.
+// cells has one element per cell, resolution divided by tengi_get_cell_pixels().
+void tengi_draw_cells(
+    IVec2       resolution,
+    const Cell  cells[],
+    const char  text[],
+    const IRect dirty[],
+    size_t      dirty_length);
+
+DrawStats tengi_get_draw_stats(void); // totals since start
 
 #if __cplusplus
 } // extern "C"
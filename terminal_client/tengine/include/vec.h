@@ -14,6 +14,7 @@
 #define VEC_INCLUDED 1
 
 #include <tgmath.h> // TODO not widely supported so we need our own s_ macros!
+#include <stdbool.h>
 
 #if __GNUC__
 #define VEC_FUNC __attribute__((warn_unused_result, nonnull())) static inline
@@ -1265,6 +1266,192 @@ VEC_FUNC Mat4Value mat4_divs(Mat4 A, Scalar s)
     return M;
 }
 
+// ----------------------------------------------------------------------------
+// Packets
+//
+// Structure of arrays types for doing the same math for VEC_PACKET_WIDTH lanes
+// at once, e.g. 8 rays with AVX2 or 16 rays with AVX-512 when Scalar is float.
+// These are GCC vector extensions, so only GCC and Clang C are supported. Check
+// VEC_PACKETS before using. Comparison operators of ScalarxN return
+// ScalarMaskxN with all bits set in true lanes, use them for masking and
+// branchless selection with sxn_select().
+
+#if __GNUC__ && !__cplusplus
+#define VEC_PACKETS 1
+
+#ifndef VEC_PACKET_BYTES
+#if __AVX512F__
+#define VEC_PACKET_BYTES 64
+#elif __AVX__
+#define VEC_PACKET_BYTES 32
+#else
+#define VEC_PACKET_BYTES 16
+#endif
+#endif
+#define VEC_PACKET_WIDTH ((int)(VEC_PACKET_BYTES/sizeof(Scalar)))
+
+typedef Scalar ScalarxN __attribute__((vector_size(VEC_PACKET_BYTES)));
+typedef __typeof__((ScalarxN){0} < (ScalarxN){0}) ScalarMaskxN;
+
+typedef struct Vec3xN
+{
+    union {
+        ScalarxN x;
+        ScalarxN r;
+    };
+    union {
+        ScalarxN y;
+        ScalarxN g;
+    };
+    union {
+        ScalarxN z;
+        ScalarxN b;
+    };
+} Vec3xN;
+
+VEC_FUNC ScalarxN sxn_inits(Scalar s)
+{
+    return (ScalarxN){0} + s;
+}
+
+VEC_FUNC ScalarxN sxn_select(ScalarMaskxN mask, ScalarxN s1, ScalarxN s2)
+{
+    return (ScalarxN)(((ScalarMaskxN)s1 & mask) | ((ScalarMaskxN)s2 & ~mask));
+}
+
+VEC_FUNC bool sxn_any(ScalarMaskxN mask)
+{
+    for (int i = 0; i < VEC_PACKET_WIDTH; ++i)
+        if (mask[i])
+            return true;
+    return false;
+}
+
+VEC_FUNC ScalarxN sxn_min(ScalarxN s1, ScalarxN s2)
+{
+    return sxn_select(s1 < s2, s1, s2);
+}
+
+VEC_FUNC ScalarxN sxn_max(ScalarxN s1, ScalarxN s2)
+{
+    return sxn_select(s1 > s2, s1, s2);
+}
+
+VEC_FUNC ScalarxN sxn_abs(ScalarxN s)
+{
+    return sxn_max(s, -s);
+}
+
+VEC_FUNC ScalarxN sxn_clamp(ScalarxN s, Scalar min, Scalar max)
+{
+    return sxn_min(sxn_max(s, sxn_inits(min)), sxn_inits(max));
+}
+
+// Compiles to a single instruction with `-fno-math-errno`.
+VEC_FUNC ScalarxN sxn_sqrt(ScalarxN s)
+{
+    ScalarxN r;
+    for (int i = 0; i < VEC_PACKET_WIDTH; ++i)
+        r[i] = sqrt(s[i]);
+    return r;
+}
+
+VEC_FUNC Vec3xN vec3xn_init(ScalarxN x, ScalarxN y, ScalarxN z)
+{
+    Vec3xN v = { {x}, {y}, {z} };
+    return v;
+}
+
+VEC_FUNC Vec3xN vec3xn_initv3(Vec3 v)
+{
+    return vec3xn_init(sxn_inits(v.x), sxn_inits(v.y), sxn_inits(v.z));
+}
+
+VEC_FUNC Vec3 vec3xn_lane(Vec3xN v, int lane)
+{
+    return vec3_init(v.x[lane], v.y[lane], v.z[lane]);
+}
+
+VEC_FUNC Vec3xN vec3xn_add(Vec3xN v1, Vec3xN v2)
+{
+    return vec3xn_init(v1.x + v2.x, v1.y + v2.y, v1.z + v2.z);
+}
+
+VEC_FUNC Vec3xN vec3xn_sub(Vec3xN v1, Vec3xN v2)
+{
+    return vec3xn_init(v1.x - v2.x, v1.y - v2.y, v1.z - v2.z);
+}
+
+VEC_FUNC Vec3xN vec3xn_mul(Vec3xN v1, Vec3xN v2)
+{
+    return vec3xn_init(v1.x * v2.x, v1.y * v2.y, v1.z * v2.z);
+}
+
+VEC_FUNC Vec3xN vec3xn_adds(Vec3xN v, ScalarxN s)
+{
+    return vec3xn_init(v.x + s, v.y + s, v.z + s);
+}
+
+VEC_FUNC Vec3xN vec3xn_subs(Vec3xN v, ScalarxN s)
+{
+    return vec3xn_init(v.x - s, v.y - s, v.z - s);
+}
+
+VEC_FUNC Vec3xN vec3xn_muls(Vec3xN v, ScalarxN s)
+{
+    return vec3xn_init(v.x * s, v.y * s, v.z * s);
+}
+
+VEC_FUNC Vec3xN vec3xn_divs(Vec3xN v, ScalarxN s)
+{
+    return vec3xn_init(v.x / s, v.y / s, v.z / s);
+}
+
+VEC_FUNC ScalarxN vec3xn_dot(Vec3xN v1, Vec3xN v2)
+{
+    return v1.x*v2.x + v1.y*v2.y + v1.z*v2.z;
+}
+
+VEC_FUNC Vec3xN vec3xn_reflect(Vec3xN v, Vec3xN n)
+{
+    return vec3xn_sub(v, vec3xn_muls(n, 2.f*vec3xn_dot(n, v)));
+}
+
+VEC_FUNC Vec3xN vec3xn_abs(Vec3xN v)
+{
+    return vec3xn_init(sxn_abs(v.x), sxn_abs(v.y), sxn_abs(v.z));
+}
+
+VEC_FUNC Vec3xN vec3xn_min(Vec3xN v1, Vec3xN v2)
+{
+    return vec3xn_init(sxn_min(v1.x, v2.x), sxn_min(v1.y, v2.y), sxn_min(v1.z, v2.z));
+}
+
+VEC_FUNC Vec3xN vec3xn_max(Vec3xN v1, Vec3xN v2)
+{
+    return vec3xn_init(sxn_max(v1.x, v2.x), sxn_max(v1.y, v2.y), sxn_max(v1.z, v2.z));
+}
+
+VEC_FUNC Vec3xN vec3xn_select(ScalarMaskxN mask, Vec3xN v1, Vec3xN v2)
+{
+    return vec3xn_init(
+        sxn_select(mask, v1.x, v2.x),
+        sxn_select(mask, v1.y, v2.y),
+        sxn_select(mask, v1.z, v2.z));
+}
+
+VEC_FUNC ScalarxN vec3xn_length(Vec3xN v)
+{
+    return sxn_sqrt(vec3xn_dot(v, v));
+}
+
+VEC_FUNC Vec3xN vec3xn_normalize(Vec3xN v)
+{
+    return vec3xn_divs(v, vec3xn_length(v));
+}
+
+#endif // __GNUC__ && !__cplusplus
+
 // ----------------------------------------------------------------------------
 // Swizzling
 
@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/epoll.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <signal.h>
 #include <errno.h>
@@ -12,6 +13,7 @@
 X11Screens g_X11;
 int g_epoll_fd;
 bool g_is_gnome;
+bool g_synchronized_output; // terminal supports DEC mode 2026
 
 // While it is possibe to get window size/position in pixels and terminal size
 // in cells, there is no way to get terminal data in pixels, so estimate it
@@ -307,6 +309,43 @@ static void run_wsl_controllers(void)
         exit(WEXITSTATUS(app_status));
 }
 
+// Every terminal answers DA1, so the answer to DECRQM comes before it or never
+static bool is_da1_answer(const char* answer)
+{
+    for (const char* s = strstr(answer, "\e[?"); s != NULL; s = strstr(s + 1, "\e[?"))
+        if (s[3 + strspn(s + 3, "0123456789;")] == 'c')
+            return true;
+    return false;
+}
+
+// Asks the terminal if it can hold off showing updates until they are complete.
+// Requires raw mode, so the answers aren't echoed.
+static bool query_synchronized_output(void)
+{
+    static const char query[] = "\e[?2026$p" "\e[c"; // DECRQM, DA1
+    if ( ! isatty(STDIN_FILENO) || ! isatty(STDOUT_FILENO))
+        return false;
+    if (write(STDOUT_FILENO, query, strlen(query)) == -1)
+        return false;
+
+    char   answer[256] = "";
+    size_t length      = 0;
+    while (length < sizeof answer - 1 && ! is_da1_answer(answer)
+        && poll(&(struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN }, 1, 200) > 0)
+    {
+        ssize_t read_length = read(STDIN_FILENO, answer + length, sizeof answer - 1 - length);
+        if (read_length <= 0)
+            break;
+        length += read_length;
+        answer[length] = '\0';
+    }
+    int mode = 0; // 1 set, 2 reset, 0 and 4 not supported
+    const char* mode_answer = strstr(answer, "\e[?2026;");
+    if (mode_answer != NULL)
+        sscanf(mode_answer, "\e[?2026;%d$y", &mode);
+    return mode == 1 || mode == 2;
+}
+
 void tengi_init(void)
 {
 	XInitThreads();
@@ -325,6 +364,9 @@ void tengi_init(void)
     g_X11.termios_current.c_lflag &= ~(ECHO | ICANON);
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &g_X11.termios_current);
 
+    // Before WSL redirects stdin
+    g_synchronized_output = query_synchronized_output();
+
     XWindowAttributes xwa;
 
     // WSL helpers are slow, only use them if X11 fails.
@@ -492,8 +534,9 @@ IVec2 tengi_get_terminal_size(void)
 IVec2 tengi_get_terminal_resolution(void)
 {
     IVec2 size = tengi_get_terminal_size();
-    size.x *= 2;
-    size.y *= 2;
+    IVec2 cell = tengi_get_cell_pixels();
+    size.x *= cell.x;
+    size.y *= cell.y;
     return size;
 }
 
@@ -1,174 +1,1278 @@
 #include <tengi.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
-Scalar color_value(Vec4 color)
+_Static_assert(sizeof(Cell) == 7, "Cell has to match cells made by OpenCL");
+
+typedef struct s_Grapheme
 {
-	return (color.r + color.g + color.b)/3.f;
+    char          bytes[4]; // UTF-8
+    unsigned char length;
+} Grapheme;
+
+// Graphemes of glyphs, indexed by pixels row by row from top left like
+// Cell.glyph. Cells without pixels or with all of them set are a space or a full
+// block for every glyph set, so cells can be drawn with only bg or fg.
+static const Grapheme quadrant_graphemes[16] = {
+    {" ", 1}, {"▘", 3}, {"▝", 3}, {"▀", 3}, {"▖", 3}, {"▌", 3}, {"▞", 3}, {"▛", 3},
+    {"▗", 3}, {"▚", 3}, {"▐", 3}, {"▜", 3}, {"▄", 3}, {"▙", 3}, {"▟", 3}, {"█", 3},
+};
+
+// Halves are block elements, the rest are sextants in the same order
+static const Grapheme sextant_graphemes[64] = {
+    {" ", 1}, {"🬀", 4}, {"🬁", 4}, {"🬂", 4}, {"🬃", 4}, {"🬄", 4}, {"🬅", 4}, {"🬆", 4},
+    {"🬇", 4}, {"🬈", 4}, {"🬉", 4}, {"🬊", 4}, {"🬋", 4}, {"🬌", 4}, {"🬍", 4}, {"🬎", 4},
+    {"🬏", 4}, {"🬐", 4}, {"🬑", 4}, {"🬒", 4}, {"🬓", 4}, {"▌", 3}, {"🬔", 4}, {"🬕", 4},
+    {"🬖", 4}, {"🬗", 4}, {"🬘", 4}, {"🬙", 4}, {"🬚", 4}, {"🬛", 4}, {"🬜", 4}, {"🬝", 4},
+    {"🬞", 4}, {"🬟", 4}, {"🬠", 4}, {"🬡", 4}, {"🬢", 4}, {"🬣", 4}, {"🬤", 4}, {"🬥", 4},
+    {"🬦", 4}, {"🬧", 4}, {"▐", 3}, {"🬨", 4}, {"🬩", 4}, {"🬪", 4}, {"🬫", 4}, {"🬬", 4},
+    {"🬭", 4}, {"🬮", 4}, {"🬯", 4}, {"🬰", 4}, {"🬱", 4}, {"🬲", 4}, {"🬳", 4}, {"🬴", 4},
+    {"🬵", 4}, {"🬶", 4}, {"🬷", 4}, {"🬸", 4}, {"🬹", 4}, {"🬺", 4}, {"🬻", 4}, {"█", 3},
+};
+
+// Not in the order of braille dot numbers, which go down the left column first
+static const Grapheme braille_graphemes[256] = {
+    {" ", 1}, {"⠁", 3}, {"⠈", 3}, {"⠉", 3}, {"⠂", 3}, {"⠃", 3}, {"⠊", 3}, {"⠋", 3},
+    {"⠐", 3}, {"⠑", 3}, {"⠘", 3}, {"⠙", 3}, {"⠒", 3}, {"⠓", 3}, {"⠚", 3}, {"⠛", 3},
+    {"⠄", 3}, {"⠅", 3}, {"⠌", 3}, {"⠍", 3}, {"⠆", 3}, {"⠇", 3}, {"⠎", 3}, {"⠏", 3},
+    {"⠔", 3}, {"⠕", 3}, {"⠜", 3}, {"⠝", 3}, {"⠖", 3}, {"⠗", 3}, {"⠞", 3}, {"⠟", 3},
+    {"⠠", 3}, {"⠡", 3}, {"⠨", 3}, {"⠩", 3}, {"⠢", 3}, {"⠣", 3}, {"⠪", 3}, {"⠫", 3},
+    {"⠰", 3}, {"⠱", 3}, {"⠸", 3}, {"⠹", 3}, {"⠲", 3}, {"⠳", 3}, {"⠺", 3}, {"⠻", 3},
+    {"⠤", 3}, {"⠥", 3}, {"⠬", 3}, {"⠭", 3}, {"⠦", 3}, {"⠧", 3}, {"⠮", 3}, {"⠯", 3},
+    {"⠴", 3}, {"⠵", 3}, {"⠼", 3}, {"⠽", 3}, {"⠶", 3}, {"⠷", 3}, {"⠾", 3}, {"⠿", 3},
+    {"⡀", 3}, {"⡁", 3}, {"⡈", 3}, {"⡉", 3}, {"⡂", 3}, {"⡃", 3}, {"⡊", 3}, {"⡋", 3},
+    {"⡐", 3}, {"⡑", 3}, {"⡘", 3}, {"⡙", 3}, {"⡒", 3}, {"⡓", 3}, {"⡚", 3}, {"⡛", 3},
+    {"⡄", 3}, {"⡅", 3}, {"⡌", 3}, {"⡍", 3}, {"⡆", 3}, {"⡇", 3}, {"⡎", 3}, {"⡏", 3},
+    {"⡔", 3}, {"⡕", 3}, {"⡜", 3}, {"⡝", 3}, {"⡖", 3}, {"⡗", 3}, {"⡞", 3}, {"⡟", 3},
+    {"⡠", 3}, {"⡡", 3}, {"⡨", 3}, {"⡩", 3}, {"⡢", 3}, {"⡣", 3}, {"⡪", 3}, {"⡫", 3},
+    {"⡰", 3}, {"⡱", 3}, {"⡸", 3}, {"⡹", 3}, {"⡲", 3}, {"⡳", 3}, {"⡺", 3}, {"⡻", 3},
+    {"⡤", 3}, {"⡥", 3}, {"⡬", 3}, {"⡭", 3}, {"⡦", 3}, {"⡧", 3}, {"⡮", 3}, {"⡯", 3},
+    {"⡴", 3}, {"⡵", 3}, {"⡼", 3}, {"⡽", 3}, {"⡶", 3}, {"⡷", 3}, {"⡾", 3}, {"⡿", 3},
+    {"⢀", 3}, {"⢁", 3}, {"⢈", 3}, {"⢉", 3}, {"⢂", 3}, {"⢃", 3}, {"⢊", 3}, {"⢋", 3},
+    {"⢐", 3}, {"⢑", 3}, {"⢘", 3}, {"⢙", 3}, {"⢒", 3}, {"⢓", 3}, {"⢚", 3}, {"⢛", 3},
+    {"⢄", 3}, {"⢅", 3}, {"⢌", 3}, {"⢍", 3}, {"⢆", 3}, {"⢇", 3}, {"⢎", 3}, {"⢏", 3},
+    {"⢔", 3}, {"⢕", 3}, {"⢜", 3}, {"⢝", 3}, {"⢖", 3}, {"⢗", 3}, {"⢞", 3}, {"⢟", 3},
+    {"⢠", 3}, {"⢡", 3}, {"⢨", 3}, {"⢩", 3}, {"⢢", 3}, {"⢣", 3}, {"⢪", 3}, {"⢫", 3},
+    {"⢰", 3}, {"⢱", 3}, {"⢸", 3}, {"⢹", 3}, {"⢲", 3}, {"⢳", 3}, {"⢺", 3}, {"⢻", 3},
+    {"⢤", 3}, {"⢥", 3}, {"⢬", 3}, {"⢭", 3}, {"⢦", 3}, {"⢧", 3}, {"⢮", 3}, {"⢯", 3},
+    {"⢴", 3}, {"⢵", 3}, {"⢼", 3}, {"⢽", 3}, {"⢶", 3}, {"⢷", 3}, {"⢾", 3}, {"⢿", 3},
+    {"⣀", 3}, {"⣁", 3}, {"⣈", 3}, {"⣉", 3}, {"⣂", 3}, {"⣃", 3}, {"⣊", 3}, {"⣋", 3},
+    {"⣐", 3}, {"⣑", 3}, {"⣘", 3}, {"⣙", 3}, {"⣒", 3}, {"⣓", 3}, {"⣚", 3}, {"⣛", 3},
+    {"⣄", 3}, {"⣅", 3}, {"⣌", 3}, {"⣍", 3}, {"⣆", 3}, {"⣇", 3}, {"⣎", 3}, {"⣏", 3},
+    {"⣔", 3}, {"⣕", 3}, {"⣜", 3}, {"⣝", 3}, {"⣖", 3}, {"⣗", 3}, {"⣞", 3}, {"⣟", 3},
+    {"⣠", 3}, {"⣡", 3}, {"⣨", 3}, {"⣩", 3}, {"⣢", 3}, {"⣣", 3}, {"⣪", 3}, {"⣫", 3},
+    {"⣰", 3}, {"⣱", 3}, {"⣸", 3}, {"⣹", 3}, {"⣲", 3}, {"⣳", 3}, {"⣺", 3}, {"⣻", 3},
+    {"⣤", 3}, {"⣥", 3}, {"⣬", 3}, {"⣭", 3}, {"⣦", 3}, {"⣧", 3}, {"⣮", 3}, {"⣯", 3},
+    {"⣴", 3}, {"⣵", 3}, {"⣼", 3}, {"⣽", 3}, {"⣶", 3}, {"⣷", 3}, {"⣾", 3}, {"█", 3},
+};
+
+static const struct { const Grapheme* graphemes; int height; } cell_glyphs[CELL_GLYPHS_LENGTH] = {
+    [CELL_GLYPHS_QUADRANTS] = { quadrant_graphemes, 2 },
+    [CELL_GLYPHS_SEXTANTS]  = { sextant_graphemes,  3 },
+    [CELL_GLYPHS_BRAILLE]   = { braille_graphemes,  4 },
+};
+#define CELL_PIXELS_MAX 8
+#define GLYPH_EMPTY     0x0
+
+static unsigned glyph_full(CellGlyphs glyphs)
+{
+    return (1u << 2*cell_glyphs[glyphs].height) - 1;
 }
 
-// We can divide a cell in 4 by using Unicode block elements. However, we only
-// have 2 colors at our disposal: background and foreground. We divide the
-// colors to back and front based on their values and average them.
-size_t draw_cell(size_t cells_length, char cells[], const Vec4 colors[static 4])
+// Columns and rows of cells of resolution in pixels of glyphs
+static IVec2 cells_size(IVec2 resolution, CellGlyphs glyphs)
 {
-    if (0) // ASCII, TODO this needs to be parameterized!
-    {
-        Vec4 color = vec4(0);
-        for (size_t i = 0; i < 4; ++i)
-            color = vec_add(color, colors[i]);
-        color = vec_clamp(vec_div(color, 4.f), 0.f, 1.f);
-        return sprintf(cells + cells_length,
-            "\e[48;2;%d;%d;%dm ",
-            (int)(255*color.r ), (int)(255*color.g ), (int)(255*color.b ));
-    }
-                                       //0123456789ABCDEF
-	static const wchar_t graphemes[] = L" ▘▝▀▖▌▞▛▗▚▐▜▄▙▟█";
-
-	size_t index       = 0;
-	Vec4 back_color  = (Vec4){0};
-	Vec4 front_color = (Vec4){0};
-	size_t back_elems  = 0;
-	size_t front_elems = 0;
-
-	Scalar max = 0.f;
-	Scalar min = 1.f;
-	for (size_t i = 0; i < 4; ++i) {
-		max = fmax(max, color_value(colors[i]));
-		min = fmin(min, color_value(colors[i]));
+    return (IVec2){ resolution.x >> 1, resolution.y/cell_glyphs[glyphs].height };
+}
+
+static const struct { char chars[3]; unsigned char length; } decimals[256] = {
+    {"0", 1}, {"1", 1}, {"2", 1}, {"3", 1}, {"4", 1}, {"5", 1}, {"6", 1}, {"7", 1}, {"8", 1}, {"9", 1},
+    {"10", 2}, {"11", 2}, {"12", 2}, {"13", 2}, {"14", 2}, {"15", 2}, {"16", 2}, {"17", 2}, {"18", 2}, {"19", 2},
+    {"20", 2}, {"21", 2}, {"22", 2}, {"23", 2}, {"24", 2}, {"25", 2}, {"26", 2}, {"27", 2}, {"28", 2}, {"29", 2},
+    {"30", 2}, {"31", 2}, {"32", 2}, {"33", 2}, {"34", 2}, {"35", 2}, {"36", 2}, {"37", 2}, {"38", 2}, {"39", 2},
+    {"40", 2}, {"41", 2}, {"42", 2}, {"43", 2}, {"44", 2}, {"45", 2}, {"46", 2}, {"47", 2}, {"48", 2}, {"49", 2},
+    {"50", 2}, {"51", 2}, {"52", 2}, {"53", 2}, {"54", 2}, {"55", 2}, {"56", 2}, {"57", 2}, {"58", 2}, {"59", 2},
+    {"60", 2}, {"61", 2}, {"62", 2}, {"63", 2}, {"64", 2}, {"65", 2}, {"66", 2}, {"67", 2}, {"68", 2}, {"69", 2},
+    {"70", 2}, {"71", 2}, {"72", 2}, {"73", 2}, {"74", 2}, {"75", 2}, {"76", 2}, {"77", 2}, {"78", 2}, {"79", 2},
+    {"80", 2}, {"81", 2}, {"82", 2}, {"83", 2}, {"84", 2}, {"85", 2}, {"86", 2}, {"87", 2}, {"88", 2}, {"89", 2},
+    {"90", 2}, {"91", 2}, {"92", 2}, {"93", 2}, {"94", 2}, {"95", 2}, {"96", 2}, {"97", 2}, {"98", 2}, {"99", 2},
+    {"100", 3}, {"101", 3}, {"102", 3}, {"103", 3}, {"104", 3}, {"105", 3}, {"106", 3}, {"107", 3}, {"108", 3}, {"109", 3},
+    {"110", 3}, {"111", 3}, {"112", 3}, {"113", 3}, {"114", 3}, {"115", 3}, {"116", 3}, {"117", 3}, {"118", 3}, {"119", 3},
+    {"120", 3}, {"121", 3}, {"122", 3}, {"123", 3}, {"124", 3}, {"125", 3}, {"126", 3}, {"127", 3}, {"128", 3}, {"129", 3},
+    {"130", 3}, {"131", 3}, {"132", 3}, {"133", 3}, {"134", 3}, {"135", 3}, {"136", 3}, {"137", 3}, {"138", 3}, {"139", 3},
+    {"140", 3}, {"141", 3}, {"142", 3}, {"143", 3}, {"144", 3}, {"145", 3}, {"146", 3}, {"147", 3}, {"148", 3}, {"149", 3},
+    {"150", 3}, {"151", 3}, {"152", 3}, {"153", 3}, {"154", 3}, {"155", 3}, {"156", 3}, {"157", 3}, {"158", 3}, {"159", 3},
+    {"160", 3}, {"161", 3}, {"162", 3}, {"163", 3}, {"164", 3}, {"165", 3}, {"166", 3}, {"167", 3}, {"168", 3}, {"169", 3},
+    {"170", 3}, {"171", 3}, {"172", 3}, {"173", 3}, {"174", 3}, {"175", 3}, {"176", 3}, {"177", 3}, {"178", 3}, {"179", 3},
+    {"180", 3}, {"181", 3}, {"182", 3}, {"183", 3}, {"184", 3}, {"185", 3}, {"186", 3}, {"187", 3}, {"188", 3}, {"189", 3},
+    {"190", 3}, {"191", 3}, {"192", 3}, {"193", 3}, {"194", 3}, {"195", 3}, {"196", 3}, {"197", 3}, {"198", 3}, {"199", 3},
+    {"200", 3}, {"201", 3}, {"202", 3}, {"203", 3}, {"204", 3}, {"205", 3}, {"206", 3}, {"207", 3}, {"208", 3}, {"209", 3},
+    {"210", 3}, {"211", 3}, {"212", 3}, {"213", 3}, {"214", 3}, {"215", 3}, {"216", 3}, {"217", 3}, {"218", 3}, {"219", 3},
+    {"220", 3}, {"221", 3}, {"222", 3}, {"223", 3}, {"224", 3}, {"225", 3}, {"226", 3}, {"227", 3}, {"228", 3}, {"229", 3},
+    {"230", 3}, {"231", 3}, {"232", 3}, {"233", 3}, {"234", 3}, {"235", 3}, {"236", 3}, {"237", 3}, {"238", 3}, {"239", 3},
+    {"240", 3}, {"241", 3}, {"242", 3}, {"243", 3}, {"244", 3}, {"245", 3}, {"246", 3}, {"247", 3}, {"248", 3}, {"249", 3},
+    {"250", 3}, {"251", 3}, {"252", 3}, {"253", 3}, {"254", 3}, {"255", 3},
+};
+
+// Colors currently set in the terminal, so that they don't have to be set again
+typedef struct s_SGRState
+{
+    bool                     fg_set;
+    bool                     bg_set;
+    unsigned char            fg[3];
+    unsigned char            bg[3];
+    const struct s_TextCell* text; // whose style is set instead of colors, NULL if none
+} SGRState;
+
+// We can divide a cell in up to 8 by using Unicode block elements or braille.
+// However, we only have 2 colors at our disposal: background and foreground.
+// The colors are split to the 2 that represent them best, by 2-means: starting
+// from a split at the middle of the channel they differ most in, they move to
+// the nearer of the 2 averages until none does. length is the number of pixels,
+// row by row from top left.
+#define CELL_SPLIT_ITERATIONS 4
+
+static unsigned char color_channel(RGBA8 color, size_t channel)
+{
+	return channel == 0 ? color.r : channel == 1 ? color.g : color.b;
+}
+
+static Cell make_cell(const RGBA8 colors[], int length)
+{
+	unsigned glyph   = 0;
+	size_t   channel = 0;
+	int      max[3]  = {0};
+	int      min[3]  = {255, 255, 255};
+	for (int i = 0; i < length; ++i)
+		for (size_t j = 0; j < 3; ++j) {
+			int value = color_channel(colors[i], j);
+			max[j] = value > max[j] ? value : max[j];
+			min[j] = value < min[j] ? value : min[j];
+		}
+	for (size_t j = 1; j < 3; ++j)
+		channel = max[j] - min[j] > max[channel] - min[channel] ? j : channel;
+	for (int i = 0; i < length; ++i) {
+		int value = color_channel(colors[i], channel);
+		glyph |= (max[channel] - value < value - min[channel]) << i;
 	}
 
-	for (size_t i = 0; i < 4; ++i) {
+	int averages[2][3]; // back and front
+	for (int iteration = 0; ; ++iteration)
+	{
+		unsigned sums[2][3] = {{0}};
+		unsigned elems[2]   = {0};
+		for (int i = 0; i < length; ++i) {
+			unsigned* sum = sums[glyph >> i & 1];
+			sum[0] += colors[i].r;
+			sum[1] += colors[i].g;
+			sum[2] += colors[i].b;
+			elems[glyph >> i & 1]++;
+		}
+		for (size_t j = 0; j < 2; ++j) // rounded averages
+			for (size_t k = 0; k < 3; ++k)
+				averages[j][k] = elems[j] == 0 ? 0 : (sums[j][k] + elems[j]/2)/elems[j];
+		if (elems[0] == 0 || elems[1] == 0 || iteration == CELL_SPLIT_ITERATIONS)
+			break;
 
-		bool bit = max - color_value(colors[i]) < color_value(colors[i]) - min;
-		if (bit) {
-		    front_color = vec_add(front_color, colors[i]);
-		    front_elems++;
-		} else {
-		    back_color  = vec_add(back_color, colors[i]);
-		    back_elems++;
+		unsigned nearer = 0;
+		for (int i = 0; i < length; ++i) {
+			int distances[2] = {0};
+			for (size_t j = 0; j < 2; ++j) {
+				int d[3] = {
+					colors[i].r - averages[j][0], colors[i].g - averages[j][1], colors[i].b - averages[j][2] };
+				distances[j] = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+			}
+			nearer |= (distances[1] < distances[0]) << i;
 		}
-		index |= bit << i;
+		if (nearer == glyph)
+			break;
+		glyph = nearer;
 	}
-	front_color = vec_clamp(vec4_divs(front_color, front_elems), 0.f, 1.f);
-	back_color  = vec_clamp(vec4_divs(back_color,  back_elems ), 0.f, 1.f);
 
-	return sprintf(cells + cells_length,
-		"\e[38;2;%d;%d;%dm"
-		"\e[48;2;%d;%d;%dm%lc",
-		(int)(255*front_color.r), (int)(255*front_color.g), (int)(255*front_color.b),
-		(int)(255*back_color.r ), (int)(255*back_color.g ), (int)(255*back_color.b ),
-		graphemes[index]);
+	return (Cell){
+		glyph,
+		{ averages[1][0], averages[1][1], averages[1][2] },
+		{ averages[0][0], averages[0][1], averages[0][2] } };
+}
+
+// ----------------------------------------------------------------------------
+// Output quality
+//
+// Cells can be written with fewer colors or less detail than they have, which
+// takes fewer bytes: palette colors have shorter SGR codes than 24-bit ones,
+// and neighbouring cells share them more often, so they don't have to be set
+// again. The same goes for cells split to halves or not split at all, instead
+// of split by their glyphs.
+
+typedef enum e_CellDetail
+{
+    DETAIL_GLYPHS,
+    DETAIL_HALVES,
+    DETAIL_FULL,
+} CellDetail;
+
+typedef struct s_OutputQuality
+{
+    OutputColors colors; // not OUTPUT_COLORS_ADAPTIVE
+    CellDetail   detail;
+    bool         dither;
+} OutputQuality;
+
+// From best to cheapest, for OUTPUT_COLORS_ADAPTIVE
+static const OutputQuality output_qualities[] = {
+    { OUTPUT_COLORS_24BIT, DETAIL_GLYPHS, false },
+    { OUTPUT_COLORS_24BIT, DETAIL_HALVES, false },
+    { OUTPUT_COLORS_256,   DETAIL_GLYPHS, false },
+    { OUTPUT_COLORS_256,   DETAIL_HALVES, false },
+    { OUTPUT_COLORS_16,    DETAIL_HALVES, false },
+    { OUTPUT_COLORS_16,    DETAIL_FULL,   false },
+};
+#define OUTPUT_QUALITIES_LENGTH (sizeof output_qualities/sizeof output_qualities[0])
+
+// xterm defaults
+static const unsigned char ansi_colors[16][3] = {
+    {  0,   0,   0}, {205,   0,   0}, {  0, 205,   0}, {205, 205,   0},
+    {  0,   0, 238}, {205,   0, 205}, {  0, 205, 205}, {229, 229, 229},
+    {127, 127, 127}, {255,   0,   0}, {  0, 255,   0}, {255, 255,   0},
+    { 92,  92, 255}, {255,   0, 255}, {  0, 255, 255}, {255, 255, 255},
+};
+static const unsigned char cube_levels[6] = { 0, 95, 135, 175, 215, 255 };
+
+static int color_distance(const unsigned char color1[3], const unsigned char color2[3])
+{
+    int r = color1[0] - color2[0];
+    int g = color1[1] - color2[1];
+    int b = color1[2] - color2[2];
+    return r*r + g*g + b*b;
+}
+
+static int nearest_ansi_color(const unsigned char rgb[3])
+{
+    int nearest = 0;
+    for (int i = 1; i < 16; ++i)
+        if (color_distance(rgb, ansi_colors[i]) < color_distance(rgb, ansi_colors[nearest]))
+            nearest = i;
+    return nearest;
+}
+
+// Nearest of the 6x6x6 color cube and the gray ramp, skipping the ANSI colors
+static int nearest_xterm_color(const unsigned char rgb[3])
+{
+    unsigned char cube[3];
+    int           cube_index = 0;
+    for (size_t i = 0; i < 3; ++i) {
+        int level  = rgb[i] < 48 ? 0 : rgb[i] < 115 ? 1 : (rgb[i] - 35)/40;
+        cube[i]    = cube_levels[level];
+        cube_index = 6*cube_index + level;
+    }
+    int gray_level = fmin(fmax(((rgb[0] + rgb[1] + rgb[2])/3 - 3)/10, 0), 23);
+    unsigned char gray[3] = { 8 + 10*gray_level, 8 + 10*gray_level, 8 + 10*gray_level };
+    return color_distance(rgb, gray) < color_distance(rgb, cube) ? 232 + gray_level : 16 + cube_index;
+}
+
+// Palette colors are looked up from colors quantized to PALETTE_LUT_BITS per
+// channel, built on first use.
+#define PALETTE_LUT_BITS 5
+
+static const unsigned char* palette_lut(OutputColors colors)
+{
+    static unsigned char luts[2][1 << 3*PALETTE_LUT_BITS]; // 256 and 16 colors
+    static bool          built[2];
+
+    size_t lut = colors == OUTPUT_COLORS_16;
+    if ( ! built[lut]) {
+        int (*nearest)(const unsigned char[3]) = lut == 0 ? nearest_xterm_color : nearest_ansi_color;
+        int levels = 1 << PALETTE_LUT_BITS;
+        int step   = 256 >> PALETTE_LUT_BITS;
+        for (int r = 0; r < levels; ++r)
+            for (int g = 0; g < levels; ++g)
+                for (int b = 0; b < levels; ++b)
+                    luts[lut][(r*levels + g)*levels + b] = nearest((unsigned char[3]){
+                        r*step + step/2, g*step + step/2, b*step + step/2 });
+        built[lut] = true;
+    }
+    return luts[lut];
+}
+
+// Ordered dithering moves colors of cells by a threshold of their position,
+// which is the same every frame, so unchanged cells stay unchanged. Thresholds
+// span about the distance between palette colors.
+static const signed char bayer_matrix[4][4] = {
+    { 0,  8,  2, 10},
+    {12,  4, 14,  6},
+    { 3, 11,  1,  9},
+    {15,  7, 13,  5},
+};
+#define DITHER_SPREAD_256 40  // between levels of the color cube
+#define DITHER_SPREAD_16  128 // roughly, ANSI colors aren't evenly spaced
+
+static int palette_color(const unsigned char rgb[3], OutputColors colors, int threshold)
+{
+    const unsigned char* lut = palette_lut(colors);
+    size_t index = 0;
+    for (size_t i = 0; i < 3; ++i) {
+        int channel = fmin(fmax(rgb[i] + threshold, 0), 255);
+        index = index << PALETTE_LUT_BITS | channel >> (8 - PALETTE_LUT_BITS);
+    }
+    return lut[index];
+}
+
+static void average_colors(unsigned char out[3], const unsigned char* colors[], size_t length)
+{
+    for (size_t i = 0; i < 3; ++i) {
+        unsigned sum = 0;
+        for (size_t j = 0; j < length; ++j)
+            sum += colors[j][i];
+        out[i] = (sum + length/2)/length;
+    }
+}
+
+// Glyphs that split cells made by output_cell()
+static CellGlyphs output_glyphs(CellGlyphs glyphs, OutputQuality quality)
+{
+    return quality.detail == DETAIL_GLYPHS ? glyphs : CELL_GLYPHS_QUADRANTS; // ▀ or space
+}
+
+// Cell split by glyphs at column x and row y as it is written with quality.
+// With palette colors, the first byte of fg and bg is the palette index and the
+// rest are 0.
+static Cell output_cell(Cell cell, CellGlyphs glyphs, OutputQuality quality, int x, int y)
+{
+    int                  height = cell_glyphs[glyphs].height;
+    const unsigned char* pixels[CELL_PIXELS_MAX];
+    for (int i = 0; i < 2*height; ++i)
+        pixels[i] = (cell.glyph >> i & 1) ? cell.fg : cell.bg;
+
+    if (quality.detail == DETAIL_HALVES) { // middle row of odd heights is in both
+        Cell half = { 0x3, {0}, {0} }; // ▀, fg on top
+        average_colors(half.fg, pixels, 2*((height + 1)/2));
+        average_colors(half.bg, pixels + 2*(height/2), 2*((height + 1)/2));
+        cell = half;
+    } else if (quality.detail == DETAIL_FULL) {
+        Cell full = { GLYPH_EMPTY, {0}, {0} };
+        average_colors(full.bg, pixels, 2*height);
+        cell = full;
+    }
+
+    if (quality.colors != OUTPUT_COLORS_24BIT) {
+        int threshold = 0;
+        if (quality.dither) {
+            int spread = quality.colors == OUTPUT_COLORS_256 ? DITHER_SPREAD_256 : DITHER_SPREAD_16;
+            threshold  = (2*bayer_matrix[y & 3][x & 3] - 15)*spread/32;
+        }
+        int fg = palette_color(cell.fg, quality.colors, threshold);
+        int bg = palette_color(cell.bg, quality.colors, threshold);
+        cell = (Cell){ cell.glyph, { fg }, { bg } };
+    }
+    bool reduced = quality.colors != OUTPUT_COLORS_24BIT || quality.detail != DETAIL_GLYPHS;
+    if (reduced && memcmp(cell.fg, cell.bg, sizeof cell.fg) == 0)
+        cell.glyph = GLYPH_EMPTY; // glyph wouldn't show, a space needs only bg
+    return cell;
+}
+
+static size_t encode_rgb(char out[], const char prefix[static 5], const unsigned char rgb[3])
+{
+    size_t length = 5;
+    if (out != NULL)
+        memcpy(out, prefix, 5);
+    for (size_t i = 0; i < 3; ++i) {
+        if (out != NULL)
+            memcpy(out + length, decimals[rgb[i]].chars, decimals[rgb[i]].length);
+        length += decimals[rgb[i]].length;
+        if (out != NULL && i < 2)
+            out[length] = ';';
+        length += i < 2;
+    }
+    return length;
 }
 
-static size_t fill_char_buffer(
-    char chars[], IVec2 resolution, const Vec4 colors[], const char* text)
+// SGR parameters of palette color index, fg or bg
+static size_t encode_palette(char out[], OutputColors colors, bool fg, int index)
+{
+    size_t length = 0;
+    if (colors == OUTPUT_COLORS_256) {
+        if (out != NULL)
+            memcpy(out, fg ? "38;5;" : "48;5;", 5);
+        length = 5;
+    } else // 30-37, 40-47, or bright 90-97, 100-107
+        index = (fg ? 30 : 40) + (index < 8 ? index : 60 + index - 8);
+    if (out != NULL)
+        memcpy(out + length, decimals[index].chars, decimals[index].length);
+    return length + decimals[index].length;
+}
+
+// Writes cell made by output_cell() to out and updates sgr. Only sets colors
+// that are visible and not already set. The cell can also be drawn with inverse
+// glyph and swapped colors, whichever needs less, except braille, whose dots
+// don't cover the cell, so inverse glyphs look different. If out is NULL, only
+// returns the length.
+static size_t encode_cell(char out[], Cell cell, CellGlyphs glyphs, OutputColors colors, SGRState* sgr)
+{
+    size_t length = 0;
+    if (sgr->text != NULL) { // text may have set more than colors
+        if (out != NULL)
+            memcpy(out, "\e[0m", strlen("\e[0m"));
+        length += strlen("\e[0m");
+        *sgr = (SGRState){0};
+    }
+
+    Cell inverse = { cell.glyph ^ glyph_full(glyphs), {0}, {0} };
+    memcpy(inverse.fg, cell.bg, sizeof inverse.fg);
+    memcpy(inverse.bg, cell.fg, sizeof inverse.bg);
+
+    bool set_fg[2];
+    bool set_bg[2];
+    const Cell* options[2]     = { &cell, &inverse };
+    size_t      options_length = glyphs == CELL_GLYPHS_BRAILLE ? 1 : 2;
+    for (size_t i = 0; i < options_length; ++i) {
+        set_fg[i] = options[i]->glyph != GLYPH_EMPTY
+            && ( ! sgr->fg_set || memcmp(sgr->fg, options[i]->fg, sizeof sgr->fg) != 0);
+        set_bg[i] = options[i]->glyph != glyph_full(glyphs)
+            && ( ! sgr->bg_set || memcmp(sgr->bg, options[i]->bg, sizeof sgr->bg) != 0);
+    }
+    size_t option = options_length > 1 && set_fg[1] + set_bg[1] < set_fg[0] + set_bg[0];
+    cell = *options[option];
+
+    if (set_fg[option] || set_bg[option]) {
+        if (out != NULL)
+            memcpy(out + length, "\e[", 2);
+        length += 2;
+    }
+    if (set_fg[option]) {
+        if (colors == OUTPUT_COLORS_24BIT)
+            length += encode_rgb(out == NULL ? NULL : out + length, "38;2;", cell.fg);
+        else
+            length += encode_palette(out == NULL ? NULL : out + length, colors, true, cell.fg[0]);
+        memcpy(sgr->fg, cell.fg, sizeof sgr->fg);
+        sgr->fg_set = true;
+    }
+    if (set_fg[option] && set_bg[option]) {
+        if (out != NULL)
+            out[length] = ';';
+        length += 1;
+    }
+    if (set_bg[option]) {
+        if (colors == OUTPUT_COLORS_24BIT)
+            length += encode_rgb(out == NULL ? NULL : out + length, "48;2;", cell.bg);
+        else
+            length += encode_palette(out == NULL ? NULL : out + length, colors, false, cell.bg[0]);
+        memcpy(sgr->bg, cell.bg, sizeof sgr->bg);
+        sgr->bg_set = true;
+    }
+    if (set_fg[option] || set_bg[option]) {
+        if (out != NULL)
+            out[length] = 'm';
+        length += 1;
+    }
+    const Grapheme* grapheme = &cell_glyphs[glyphs].graphemes[cell.glyph];
+    if (out != NULL)
+        memcpy(out + length, grapheme->bytes, grapheme->length);
+    return length + grapheme->length;
+}
+
+static size_t digits(int n)
+{
+    return n >= 100 ? 3 : n >= 10 ? 2 : 1;
+}
+
+// ----------------------------------------------------------------------------
+// Text
+//
+// Text is drawn over cells from the top left, a line per terminal row and a
+// character per cell. Characters keep the SGR sequences in effect for them, so
+// they can be written on their own, and only the ones that changed are, like
+// the cells under them.
+
+#define TEXT_STYLE_MAX 32 // bytes of SGR sequences of a character
+
+typedef struct s_TextCell
+{
+    char          style[TEXT_STYLE_MAX]; // SGR sequences since the start of the line
+    unsigned char style_length;
+    char          ch;
+} TextCell;
+
+typedef struct s_Text
+{
+    TextCell* cells;
+    size_t    cells_capacity;
+    int*      lines; // index to cells where each line starts, and where the last ends
+    size_t    lines_capacity;
+    int       lines_length;
+} Text;
+
+// TODO only SGR sequences and single byte characters are handled, but that is
+// all the menus of ft_transcendence use.
+static void parse_text(Text* out, const char text[])
 {
     if (text == NULL)
         text = "";
-    size_t chars_length = 0;
+    size_t length = strlen(text);
+    size_t lines  = 2;
+    for (const char* c = text; *c != '\0'; ++c)
+        lines += *c == '\n';
+    if (length > out->cells_capacity) {
+        free(out->cells);
+        assert((out->cells = malloc(length*sizeof out->cells[0])));
+        out->cells_capacity = length;
+    }
+    if (lines > out->lines_capacity) {
+        free(out->lines);
+        assert((out->lines = malloc(lines*sizeof out->lines[0])));
+        out->lines_capacity = lines;
+    }
 
-	for (int y = 0; y < resolution.y; y += 2)
-	{
-        bool line_ended = false;
-        if (*text != '\0') {
-            memcpy(chars + chars_length, "\e[0m", strlen("\e[0m"));
-            chars_length += strlen("\e[0m");
-        }
-		for (int x = 0; x < resolution.x; x += 2)
-        {
-            // TODO skipping ANSI escape sequences work with the assumption
-            // of having max 2 24 bit color codes (fg and bg) per 2 byte
-            // character. Breaking that assumption may overflow. We know that
-            // this assumption holds for ft_transcendence (no user input, just
-            // hard coded menus), but THIS MUST BE FIXED FOR THE FINAL LIBRARY!
-            while ( ! line_ended && *text == '\e') {
-                while (*text != 'm')
-                    chars[chars_length++] = *text++;
-                chars[chars_length++] = *text++;
-            }
-            if (*text == '\n') {
-                line_ended = true;
-                ++text;
-            }
-            if (*text != '\0' && !line_ended) {
-                chars[chars_length++] = *text++;
+    TextCell cell         = {0};
+    int      cells_length = 0;
+    out->lines[0]     = 0;
+    out->lines_length = 0;
+    while (*text != '\0')
+    {
+        if (*text == '\e') {
+            const char* end = strchr(text, 'm');
+            if (end == NULL)
+                break;
+            size_t sequence_length = end + 1 - text;
+            bool   reset           = sequence_length == strlen("\e[0m")
+                ? memcmp(text, "\e[0m", sequence_length) == 0
+                : sequence_length == strlen("\e[m") && memcmp(text, "\e[m", sequence_length) == 0;
+            if (reset || cell.style_length + sequence_length > TEXT_STYLE_MAX) // keep the newest
+                cell.style_length = 0;
+            if ( ! reset && sequence_length <= TEXT_STYLE_MAX) {
+                memcpy(cell.style + cell.style_length, text, sequence_length);
+                cell.style_length += sequence_length;
             }
-            else if (0 && colors != NULL && x < resolution.x-2 && y < resolution.y-2) { // AA // TODO PARAMETERIZE AA
+            text = end + 1;
+        } else if (*text == '\n') {
+            out->lines[++out->lines_length] = cells_length;
+            cell.style_length = 0;
+            ++text;
+        } else {
+            cell.ch = *text++;
+            out->cells[cells_length++] = cell;
+        }
+    }
+    if (cells_length > out->lines[out->lines_length]) // last line has no newline
+        out->lines[++out->lines_length] = cells_length;
+}
 
-                Vec4 char_colors9[3][3];
-                for (size_t y3 = 0; y3 < 3; ++y3)
-                    for (size_t x3 = 0; x3 < 3; ++x3)
-                        char_colors9[y3][x3] = vec_clamp(colors[(y + y3)*resolution.x + (x + x3)%resolution.x], 0.f, 1.f);
+static void free_text(Text* text)
+{
+    free(text->cells);
+    free(text->lines);
+}
 
-                Vec4 char_colors[4];
-                char_colors[0] = vec_div(vec_add(vec_add(vec_add(char_colors9[0][0], char_colors9[0][1]), char_colors9[1][0]), char_colors9[1][1]), 4.f);
-                char_colors[1] = vec_div(vec_add(vec_add(vec_add(char_colors9[0][1], char_colors9[0][2]), char_colors9[1][1]), char_colors9[1][2]), 4.f);
-                char_colors[2] = vec_div(vec_add(vec_add(vec_add(char_colors9[1][0], char_colors9[1][1]), char_colors9[2][0]), char_colors9[2][1]), 4.f);
-                char_colors[3] = vec_div(vec_add(vec_add(vec_add(char_colors9[1][1], char_colors9[1][2]), char_colors9[2][1]), char_colors9[2][2]), 4.f);
+// Characters of text on row y, no more than columns
+static const TextCell* text_row(const Text* text, int y, int columns, int* length)
+{
+    *length = 0;
+    if (y >= text->lines_length)
+        return NULL;
+    *length = fmin(text->lines[y + 1] - text->lines[y], columns);
+    return &text->cells[text->lines[y]];
+}
 
-                chars_length += draw_cell(chars_length, chars, char_colors);
-            }
-            else if (colors != NULL) { // no AA
-                Vec4 char_colors[4] = {
-                    vec_clamp(colors[(y + 0)*resolution.x + (x + 0)%resolution.x], 0.f, 1.f),
-                    vec_clamp(colors[(y + 0)*resolution.x + (x + 1)%resolution.x], 0.f, 1.f),
-                    vec_clamp(colors[(y + 1)*resolution.x + (x + 0)%resolution.x], 0.f, 1.f),
-                    vec_clamp(colors[(y + 1)*resolution.x + (x + 1)%resolution.x], 0.f, 1.f),
-                };
-                chars_length += draw_cell(chars_length, chars, char_colors);
-            }
-		}
-		chars[chars_length++] = '\n';
-	}
-	chars_length -= strlen("\n");
-	strcpy(chars + chars_length, "\e[0m\e[0;0H");
-	return chars_length + strlen("\e[0m\e[0;0H");
+static bool same_text_cell(const TextCell* cell1, const TextCell* cell2)
+{
+    return cell1->ch == cell2->ch
+        && cell1->style_length == cell2->style_length
+        && memcmp(cell1->style, cell2->style, cell1->style_length) == 0;
+}
+
+// Writes cell to out and updates sgr, see encode_cell(). Its style may set more
+// than colors, so it's set after a reset, unless it's set already. If out is
+// NULL, only returns the length.
+static size_t encode_text_cell(char out[], const TextCell* cell, SGRState* sgr)
+{
+    size_t length = 0;
+    if (sgr->text == NULL || sgr->text->style_length != cell->style_length
+        || memcmp(sgr->text->style, cell->style, cell->style_length) != 0)
+    {
+        if (out != NULL) {
+            memcpy(out, "\e[0m", strlen("\e[0m"));
+            memcpy(out + strlen("\e[0m"), cell->style, cell->style_length);
+        }
+        length += strlen("\e[0m") + cell->style_length;
+    }
+    if (out != NULL)
+        out[length] = cell->ch;
+    *sgr = (SGRState){ .text = cell };
+    return length + 1;
 }
 
 // TEMP for ft_transcendence
 #include "../../include/gamestate.h"
 
-static char* s_draw_chars = NULL;
+// ----------------------------------------------------------------------------
+// Present thread
+//
+// Drawing only turns pixels to cells and hands the frame over to a present
+// thread, which encodes and writes it, so a slow terminal doesn't hold up
+// rendering the next frame. Frames are triple buffered: back is being drawn,
+// ready is the newest finished frame and front is being written. A frame that
+// is still ready when the next one is finished is dropped, and the cells that
+// changed in it are carried over to the next one.
+
+typedef struct s_PresentFrame
+{
+    Cell*      cells;         // every cell of the frame
+    bool*      changed_cells; // since the frame before, or before any dropped ones
+    IVec2      resolution;
+    CellGlyphs glyphs;        // that split cells to pixels of resolution
+    bool       redraw_all;    // terminal may not show the frame before
+    Text       text;          // drawn over cells
+} PresentFrame;
+
+static pthread_mutex_t s_present_lock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  s_frame_ready_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  s_presented_cond   = PTHREAD_COND_INITIALIZER;
+static pthread_t       s_present_thread;
+static bool            s_present_started  = false;
+static bool            s_present_exit     = false;
+static PresentFrame    s_frames[3];
+static int             s_back             = 0; // only changed by drawing thread
+static int             s_ready            = 1;
+static int             s_front            = 2; // only changed by present thread
+static bool            s_frame_ready      = false;
+static bool            s_presenting       = false;
+static DrawStats       s_draw_stats;
 
-static void free_draw_chars(void)
+// Drawing thread
+static Cell*      s_cells           = NULL; // of the last frame drawn
+static bool*      s_dirty_cells     = NULL;
+static IVec2      s_draw_resolution = {0};
+static CellGlyphs s_draw_glyphs     = CELL_GLYPHS_QUADRANTS; // of s_cells
+static CellGlyphs s_cell_glyphs     = CELL_GLYPHS_QUADRANTS; // of the next frame
+
+// Present thread
+static char*         s_draw_chars       = NULL; // row buffers s_row_capacity apart
+static struct iovec* s_chunks           = NULL; // of a frame to write
+static size_t        s_row_capacity     = 0;
+static IVec2         s_chars_size       = {0}; // in cells
+static bool          s_terminal_in_sync = false; // terminal shows exactly the front frame
+static Text          s_shown_text;               // of the front frame
+static int           s_output_fd        = -1;
+
+static void stop_presenting(void)
 {
+    if (s_present_started) {
+        pthread_mutex_lock(&s_present_lock);
+        s_present_exit = true;
+        pthread_cond_signal(&s_frame_ready_cond);
+        pthread_mutex_unlock(&s_present_lock);
+        pthread_join(s_present_thread, NULL);
+    }
+    for (size_t i = 0; i < sizeof s_frames/sizeof s_frames[0]; ++i) {
+        free(s_frames[i].cells);
+        free(s_frames[i].changed_cells);
+        free_text(&s_frames[i].text);
+    }
+    free_text(&s_shown_text);
+    free(s_cells);
+    free(s_dirty_cells);
     free(s_draw_chars);
+    free(s_chunks);
+    if (s_output_fd > STDERR_FILENO)
+        close(s_output_fd);
 }
 
-// TODO text is a temporary hack for rudiemntary menus and debug info. Currently
-// only text and ANSI colors are handled properly, any other escape sequences
-// break! We should do somehting more sophisticated than a null terminated
-// character array.
-void tengi_draw(IVec2 resolution, const Vec4 colors[], const char text[])
+DrawStats tengi_get_draw_stats(void)
 {
-    static IVec2 last_resolution;
+    pthread_mutex_lock(&s_present_lock);
+    DrawStats stats = s_draw_stats;
+    pthread_mutex_unlock(&s_present_lock);
+    return stats;
+}
 
-    if (resolution.x != last_resolution.x || resolution.y != last_resolution.y)
-    {
-        if (s_draw_chars == NULL)
-            atexit(free_draw_chars);
+void tengi_set_cell_glyphs(CellGlyphs glyphs)
+{
+    s_cell_glyphs = glyphs;
+}
 
-        IVec2 terminal_size = { resolution.x >> 1, resolution.y >> 1 };
-        size_t chars_buffer_size = terminal_size.x*terminal_size.y*snprintf(NULL, 0,
-            "\e[38;2;%d;%d;%dm"
-            "\e[48;2;%d;%d;%dm%lc",
-            255, 255, 255, 255, 255, 255, L'█')
-            + terminal_size.y*strlen("\e[0m\n")
-            + sizeof"\e[0m\e[0;0H";
+IVec2 tengi_get_cell_pixels(void)
+{
+    return (IVec2){ 2, cell_glyphs[s_cell_glyphs].height };
+}
 
-        assert((s_draw_chars = malloc(chars_buffer_size)));
-        last_resolution = resolution;
-    }
+// Returns true if cells were reallocated, so they all have to be drawn
+static bool resize_draw_buffers(IVec2 resolution)
+{
+    if (resolution.x == s_draw_resolution.x && resolution.y == s_draw_resolution.y
+        && s_cell_glyphs == s_draw_glyphs)
+        return false;
+    if (s_cells == NULL)
+        atexit(stop_presenting);
 
-    size_t chars_length = fill_char_buffer(s_draw_chars, resolution, colors, text);
+    IVec2  size         = cells_size(resolution, s_cell_glyphs);
+    size_t cells_length = (size_t)size.x*size.y;
+    free(s_cells);
+    free(s_dirty_cells);
+    assert((s_cells       = calloc(cells_length, sizeof s_cells[0])));
+    assert((s_dirty_cells = malloc(cells_length*sizeof s_dirty_cells[0])));
+    s_draw_resolution = resolution;
+    s_draw_glyphs     = s_cell_glyphs;
+    return true;
+}
 
-    // Temporary ft_transcendence related hack to prevent drawing to outdated
-    // terminal size. Not thread safe, but has no impact on the correctness of
-    // the program.
+static void resize_frame(PresentFrame* frame, IVec2 resolution, CellGlyphs glyphs)
+{
+    if (resolution.x == frame->resolution.x && resolution.y == frame->resolution.y
+        && glyphs == frame->glyphs)
+        return;
+    IVec2  size         = cells_size(resolution, glyphs);
+    size_t cells_length = (size_t)size.x*size.y;
+    free(frame->cells);
+    free(frame->changed_cells);
+    assert((frame->cells         = malloc(cells_length*sizeof frame->cells[0])));
+    assert((frame->changed_cells = malloc(cells_length*sizeof frame->changed_cells[0])));
+    frame->resolution = resolution;
+    frame->glyphs     = glyphs;
+}
+
+// size is in cells
+static void resize_draw_chars(IVec2 size)
+{
+    if (size.x == s_chars_size.x && size.y == s_chars_size.y)
+        return;
+
+    // Cells never take more than this, moving the cursor between them takes
+    // less than skipped cells would. Text may be reset on either side.
+    size_t cell_capacity = fmax(
+        strlen("\e[38;2;255;255;255;48;2;255;255;255m") + sizeof((Grapheme){0}).bytes, TEXT_STYLE_MAX + 1);
+    s_row_capacity = strlen("\e[9999;9999H")
+        + size.x*(2*strlen("\e[0m") + cell_capacity)
+        + strlen("\e[0m\n");
+    size_t chars_buffer_size = size.y*s_row_capacity + sizeof"\e[0m\e[0;0H";
+
+    free(s_draw_chars);
+    free(s_chunks);
+    assert((s_draw_chars = malloc(chars_buffer_size)));
+    assert((s_chunks     = malloc((size.y + 3)*sizeof s_chunks[0]))); // rows, end, sync
+    s_chars_size       = size;
+    s_terminal_in_sync = false;
+}
+
+// Temporary ft_transcendence related hack to prevent drawing to outdated
+// terminal size. Not thread safe, but has no impact on the correctness of the
+// program.
+static bool terminal_outdated(void)
+{
     extern Events g_events;
     bool should_redraw = g_events.should_redraw;
     g_events.should_redraw = false;
+    return should_redraw;
+}
+
+// Encodes cell x of row y with its text, if it has any, or with quality
+static size_t encode_row_cell(
+    char                chars[],
+    int                 x,
+    int                 y,
+    const PresentFrame* frame,
+    const TextCell      text[],
+    int                 text_length,
+    OutputQuality       quality,
+    SGRState*           sgr)
+{
+    if (x < text_length)
+        return encode_text_cell(chars, &text[x], sgr);
+    int columns = cells_size(frame->resolution, frame->glyphs).x;
+    return encode_cell(
+        chars,
+        output_cell(frame->cells[y*columns + x], frame->glyphs, quality, x, y),
+        output_glyphs(frame->glyphs, quality),
+        quality.colors,
+        sgr);
+}
+
+// Encodes the cells of row y that changed with quality, jumping the cursor over
+// the rest. Cells under text changed if the text did, and cells text was
+// removed from did too. If redraw_all, every cell is encoded. Encodes the full
+// row instead if that's shorter, which has full_length. SGR state doesn't carry
+// over rows, so rows can be encoded in any order, and text is reset at the end.
+static size_t fill_row_buffer(
+    char                chars[],
+    int                 y,
+    const PresentFrame* frame,
+    OutputQuality       quality,
+    bool                redraw_all,
+    size_t*             full_length)
+{
+    int         columns       = cells_size(frame->resolution, frame->glyphs).x;
+    const bool* changed_cells = &frame->changed_cells[y*columns];
+    int         cursor        = -1;
+    size_t      chars_length  = 0;
+    SGRState    sgr           = {0};
+    SGRState    full_sgr      = {0};
+
+    int             text_length;
+    int             shown_length;
+    const TextCell* text  = text_row(&frame->text,  y, columns, &text_length);
+    const TextCell* shown = text_row(&s_shown_text, y, columns, &shown_length);
+
+    *full_length = snprintf(NULL, 0, "\e[%dH", y + 1);
+
+    for (int x = 0; x < columns && ! redraw_all; ++x) // full row is shorter when redrawing all
+    {
+        bool changed = x < text_length
+            ? x >= shown_length || ! same_text_cell(&text[x], &shown[x])
+            : changed_cells[x] || x < shown_length;
+        if (changed)
+        {
+            if (cursor == -1) // CUP
+                chars_length += sprintf(chars + chars_length, "\e[%d;%dH", y + 1, x + 1);
+            else if (cursor != x && digits(x - cursor) <= digits(x + 1)) // CUF
+                chars_length += sprintf(chars + chars_length, "\e[%dC", x - cursor);
+            else if (cursor != x) // CHA
+                chars_length += sprintf(chars + chars_length, "\e[%dG", x + 1);
+            chars_length += encode_row_cell(
+                chars + chars_length, x, y, frame, text, text_length, quality, &sgr);
+            cursor = x + 1;
+        }
+        *full_length += encode_row_cell(NULL, x, y, frame, text, text_length, quality, &full_sgr);
+    }
+    if (sgr.text != NULL)
+        chars_length += sprintf(chars + chars_length, "\e[0m");
+    if (full_sgr.text != NULL)
+        *full_length += strlen("\e[0m");
+
+    if (redraw_all || chars_length > *full_length)
+    {
+        chars_length = sprintf(chars, "\e[%dH", y + 1);
+        sgr = (SGRState){0};
+        for (int x = 0; x < columns; ++x)
+            chars_length += encode_row_cell(
+                chars + chars_length, x, y, frame, text, text_length, quality, &sgr);
+        if (sgr.text != NULL)
+            chars_length += sprintf(chars + chars_length, "\e[0m");
+        *full_length = chars_length;
+    }
+    return chars_length;
+}
+
+// Non-blocking descriptor of stdout, which is left blocking for others. Writes
+// to stdout would block the present thread until all of a frame is written,
+// which the terminal may not take for a long time over slow links.
+static int output_fd(void)
+{
+    if (s_output_fd != -1)
+        return s_output_fd;
+    struct stat info;
+    bool reopen = isatty(STDOUT_FILENO)
+        || (fstat(STDOUT_FILENO, &info) == 0 && S_ISFIFO(info.st_mode)); // files would be truncated
+    if (reopen)
+        s_output_fd = open("/proc/self/fd/1", O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (s_output_fd == -1)
+        s_output_fd = STDOUT_FILENO;
+    return s_output_fd;
+}
+
+// Writes all of chunks, polling while the terminal doesn't take more. Frames
+// are never abandoned half way, that would leave the terminal in the middle of
+// an escape sequence. Returns the bytes per second written since the terminal
+// first made it wait, before that they only went to a buffer. 0 if it didn't.
+static double write_chunks(struct iovec chunks[], int chunks_length)
+{
+    int    fd            = output_fd();
+    bool   waited        = false;
+    double wait_start    = 0.;
+    size_t written_since = 0;
+    while (chunks_length > 0)
+    {
+        ssize_t written = writev(fd, chunks, fmin(chunks_length, UIO_MAXIOV));
+        if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if ( ! waited)
+                wait_start = tengi_time();
+            waited = true;
+            poll(&(struct pollfd){ .fd = fd, .events = POLLOUT }, 1, -1);
+            continue;
+        }
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written == -1) // terminal is gone
+            break;
+        if (waited)
+            written_since += written;
+        for (; chunks_length > 0 && (size_t)written >= chunks->iov_len; ++chunks, --chunks_length)
+            written -= chunks->iov_len;
+        if (chunks_length > 0) {
+            chunks->iov_base = (char*)chunks->iov_base + written;
+            chunks->iov_len -= written;
+        }
+    }
+    double time = tengi_time() - wait_start;
+    return waited && written_since > 0 && time > 0. ? written_since/time : 0.;
+}
+
+// ----------------------------------------------------------------------------
+// Output bitrate
+//
+// Frames are written with the best output quality the terminal takes at the
+// rate they are drawn. Every OUTPUT_BALANCE_FRAMES written frames, quality steps
+// down if frames were dropped because the terminal was behind. It steps up if
+// the terminal kept up without waiting, and the better quality fits the drain
+// rate with OUTPUT_HEADROOM to spare, judging by the bytes per frame it took
+// when it was last used. If not, it steps up anyway after probe_windows windows
+// to find out if the link got faster, and if that fails, waits twice as long
+// before the next probe. After stepping up, a band of rows walking down the
+// terminal is redrawn every frame, so cells that don't change get the better
+// quality too without writing them all at once. Adaptive colors step through
+// output_qualities, others only change detail.
+
+#define OUTPUT_BALANCE_FRAMES    16
+#define OUTPUT_HEADROOM          .8
+#define OUTPUT_PROBE_WINDOWS     4  // of OUTPUT_BALANCE_FRAMES
+#define OUTPUT_PROBE_WINDOWS_MAX 64
+
+typedef struct s_OutputControl
+{
+    OutputQuality      qualities[OUTPUT_QUALITIES_LENGTH]; // to pick from, best first
+    size_t             qualities_length;
+    size_t             quality; // index to qualities
+    double             frame_bytes[OUTPUT_QUALITIES_LENGTH]; // averages, 0 if not used
+    int                frames;  // written in this window
+    size_t             bytes;
+    bool               waited;
+    unsigned long long dropped; // s_draw_stats.frames_dropped when the window started
+    double             start;
+    int                calm_windows;  // in a row without waiting for the terminal
+    int                probe_windows; // calm windows before stepping up regardless
+    bool               probing;
+    int                refresh_row; // first row of the next band to redraw, -1 if none
+} OutputControl;
+
+static OutputControl s_output_control;
+static OutputColors  s_output_colors  = OUTPUT_COLORS_ADAPTIVE;
+static bool          s_output_dither  = false;
+static bool          s_output_changed = true; // s_output_control has to be reset
+
+void tengi_set_output_colors(OutputColors colors, bool dither)
+{
+    pthread_mutex_lock(&s_present_lock);
+    s_output_changed = s_output_changed || colors != s_output_colors || dither != s_output_dither;
+    s_output_colors  = colors;
+    s_output_dither  = dither;
+    pthread_mutex_unlock(&s_present_lock);
+}
+
+// Call with s_present_lock
+static void output_control_init(OutputControl* control, OutputColors colors, bool dither)
+{
+    *control = (OutputControl){
+        .dropped       = s_draw_stats.frames_dropped,
+        .start         = tengi_time(),
+        .probe_windows = OUTPUT_PROBE_WINDOWS,
+        .refresh_row   = -1,
+    };
+    if (colors == OUTPUT_COLORS_ADAPTIVE)
+        for (size_t i = 0; i < OUTPUT_QUALITIES_LENGTH; ++i) {
+            control->qualities[i]        = output_qualities[i];
+            control->qualities[i].dither = dither;
+            control->qualities_length++;
+        }
+    else
+        for (CellDetail detail = DETAIL_GLYPHS; detail <= DETAIL_FULL; ++detail)
+            control->qualities[control->qualities_length++] = (OutputQuality){ colors, detail, dither };
+}
+
+// Call with s_present_lock after writing a frame
+static void output_control_update(OutputControl* control, DrawStats frame)
+{
+    control->frames++;
+    control->bytes  += frame.bytes_written;
+    control->waited |= frame.drain_rate > 0.;
+    if (control->frames < OUTPUT_BALANCE_FRAMES)
+        return;
+
+    double  now         = tengi_time();
+    double  dropped     = s_draw_stats.frames_dropped - control->dropped;
+    double  frame_rate  = (control->frames + dropped)/(now - control->start); // drawn
+    double* frame_bytes = &control->frame_bytes[control->quality];
+    double  bytes       = (double)control->bytes/control->frames;
+    *frame_bytes = *frame_bytes == 0. ? bytes : .8 * *frame_bytes + .2*bytes;
+
+    if (control->probing)
+        control->probe_windows = dropped > 0
+            ? fmin(2*control->probe_windows, OUTPUT_PROBE_WINDOWS_MAX)
+            : OUTPUT_PROBE_WINDOWS;
+    control->probing = false;
+
+    if (dropped > 0) {
+        control->quality      = fmin(control->quality + 1, control->qualities_length - 1);
+        control->calm_windows = 0;
+    } else if (control->waited)
+        control->calm_windows = 0;
+    else if (control->quality > 0)
+    {
+        control->calm_windows++;
+        double drain_rate   = s_draw_stats.drain_rate;
+        double better_bytes = control->frame_bytes[control->quality - 1];
+        bool   fits         = drain_rate == 0. || better_bytes*frame_rate < OUTPUT_HEADROOM*drain_rate;
+        if (fits || control->calm_windows >= control->probe_windows) {
+            control->probing      = ! fits;
+            control->quality     -= 1;
+            control->calm_windows = 0;
+            control->refresh_row  = 0;
+        }
+    }
 
-    if ( ! should_redraw) // don't draw to outdated terminal
-        (int){0} = write(STDOUT_FILENO, s_draw_chars, chars_length);
+    control->frames  = 0;
+    control->bytes   = 0;
+    control->waited  = false;
+    control->dropped = s_draw_stats.frames_dropped;
+    control->start   = now;
 }
 
+// Encodes and writes frame, returns what it took. drain_rate is only set if the
+// terminal couldn't take the frame at once.
+static DrawStats present_frame(const PresentFrame* frame, OutputQuality quality)
+{
+    extern bool g_synchronized_output;
+    static const char sync_begin[] = "\e[?2026h"; // terminal shows nothing new until sync_end
+    static const char sync_end[]   = "\e[?2026l";
+    static const char end[]        = "\e[0m\e[0;0H";
+
+    DrawStats stats = {0};
+    IVec2     size  = cells_size(frame->resolution, frame->glyphs);
+    resize_draw_chars(size);
+    bool redraw_all = frame->redraw_all || ! s_terminal_in_sync;
+    bool outdated   = terminal_outdated();
+
+    int    chunks_length = 0;
+    size_t chars_length  = 0;
+    size_t full_length   = 0;
+    if (g_synchronized_output)
+        s_chunks[chunks_length++] = (struct iovec){ (char*)sync_begin, strlen(sync_begin) };
+    if (outdated) // don't draw to outdated terminal
+        ;
+    else
+    {
+        int  rows          = size.y;
+        int  refresh_begin = redraw_all ? -1 : s_output_control.refresh_row;
+        int  refresh_end   = refresh_begin + (rows + OUTPUT_BALANCE_FRAMES - 1)/OUTPUT_BALANCE_FRAMES;
+        s_output_control.refresh_row = refresh_begin == -1 || refresh_end >= rows ? -1 : refresh_end;
+
+        for (int row = 0; row < rows; ++row)
+        {
+            bool   redraw_row = redraw_all || (row >= refresh_begin && row < refresh_end);
+            size_t row_full_length;
+            size_t row_length = fill_row_buffer(
+                s_draw_chars + row*s_row_capacity, row, frame, quality, redraw_row, &row_full_length);
+            if (row_length != 0)
+                s_chunks[chunks_length++] = (struct iovec){ s_draw_chars + row*s_row_capacity, row_length };
+            chars_length += row_length;
+            full_length  += row_full_length;
+        }
+        s_chunks[chunks_length++] = (struct iovec){ (char*)end, strlen(end) };
+        chars_length += strlen(end);
+        full_length  += strlen(end);
+    }
+    if (g_synchronized_output)
+        s_chunks[chunks_length++] = (struct iovec){ (char*)sync_end, strlen(sync_end) };
+
+    if ( ! outdated)
+    {
+        stats.drain_rate = write_chunks(s_chunks, chunks_length);
+        stats.frames++;
+        stats.bytes_written += chars_length;
+        stats.bytes_saved   += full_length - chars_length;
+    }
+    s_terminal_in_sync = ! outdated;
+    return stats;
+}
+
+static void* present_loop(void* param)
+{
+    (void)param;
+    pthread_mutex_lock(&s_present_lock);
+    while (true)
+    {
+        while ( ! s_frame_ready && ! s_present_exit)
+            pthread_cond_wait(&s_frame_ready_cond, &s_present_lock);
+        if ( ! s_frame_ready) // exiting, and the last frame is written
+            break;
+        int front     = s_ready;
+        s_ready       = s_front;
+        s_front       = front;
+        s_frame_ready = false;
+        s_presenting  = true;
+        if (s_output_changed) {
+            output_control_init(&s_output_control, s_output_colors, s_output_dither);
+            s_output_changed   = false;
+            s_terminal_in_sync = false;
+        }
+        OutputQuality quality = s_output_control.qualities[s_output_control.quality];
+        pthread_mutex_unlock(&s_present_lock);
+
+        DrawStats stats = present_frame(&s_frames[front], quality);
+
+        // The front frame isn't read again, so its text is swapped in instead
+        // of copied.
+        Text shown_text      = s_shown_text;
+        s_shown_text         = s_frames[front].text;
+        s_frames[front].text = shown_text;
+
+        pthread_mutex_lock(&s_present_lock);
+        s_draw_stats.frames        += stats.frames;
+        s_draw_stats.bytes_written += stats.bytes_written;
+        s_draw_stats.bytes_saved   += stats.bytes_saved;
+        if (stats.drain_rate > 0.)
+            s_draw_stats.drain_rate = s_draw_stats.drain_rate == 0.
+                ? stats.drain_rate
+                : .8*s_draw_stats.drain_rate + .2*stats.drain_rate;
+        if (stats.frames > 0)
+            output_control_update(&s_output_control, stats);
+        s_presenting = false;
+        pthread_cond_broadcast(&s_presented_cond);
+    }
+    pthread_mutex_unlock(&s_present_lock);
+    return NULL;
+}
+
+void tengi_draw_flush(void)
+{
+    pthread_mutex_lock(&s_present_lock);
+    while (s_frame_ready || s_presenting)
+        pthread_cond_wait(&s_presented_cond, &s_present_lock);
+    pthread_mutex_unlock(&s_present_lock);
+}
+
+// Updates dirty cells of row y from colors, or takes them from row_cells if
+// colors is NULL, and marks the ones that changed in the back frame.
+static void update_row_cells(int y, const RGBA8 colors[], const Cell row_cells[])
+{
+    IVec2       resolution    = s_draw_resolution;
+    int         height        = cell_glyphs[s_draw_glyphs].height;
+    int         columns       = resolution.x >> 1;
+    Cell*       cells         = &s_cells[y*columns];
+    const bool* dirty_cells   = &s_dirty_cells[y*columns];
+    bool*       changed_cells = &s_frames[s_back].changed_cells[y*columns];
+
+    for (int x = 0; x < columns; ++x)
+    {
+        if ( ! dirty_cells[x])
+            continue;
+        Cell new_cell;
+        if (colors != NULL) {
+            RGBA8 pixels[CELL_PIXELS_MAX];
+            for (int i = 0; i < 2*height; ++i)
+                pixels[i] = colors[(i >> 1)*resolution.x + (2*x + (i & 1))%resolution.x];
+            new_cell = make_cell(pixels, 2*height);
+        }
+        else
+            new_cell = row_cells[x];
+        if (memcmp(&new_cell, &cells[x], sizeof new_cell) != 0) {
+            cells[x]         = new_cell;
+            changed_cells[x] = true;
+        }
+    }
+}
+
+bool tengi_draw_begin(IVec2 resolution, const IRect dirty[], size_t dirty_length)
+{
+    bool resized = resize_draw_buffers(resolution);
+
+    int    height        = cell_glyphs[s_draw_glyphs].height;
+    IVec2  terminal_size = cells_size(resolution, s_draw_glyphs);
+    size_t cells_length  = (size_t)terminal_size.x*terminal_size.y;
+
+    PresentFrame* back = &s_frames[s_back];
+    resize_frame(back, resolution, s_draw_glyphs);
+    memset(back->changed_cells, resized, cells_length*sizeof back->changed_cells[0]);
+    back->redraw_all = resized;
+
+    bool all = resized || dirty == NULL;
+    memset(s_dirty_cells, all, cells_length*sizeof s_dirty_cells[0]);
+    for (size_t i = 0; ! all && i < dirty_length; ++i)
+    {
+        int x0 = fmax(dirty[i].x0 >> 1, 0);
+        int y0 = fmax(dirty[i].y0/height, 0);
+        int x1 = fmin((dirty[i].x1 + 1) >> 1, terminal_size.x);
+        int y1 = fmin((dirty[i].y1 + height - 1)/height, terminal_size.y);
+        for (int y = y0; y < y1; ++y)
+            for (int x = x0; x < x1; ++x)
+                s_dirty_cells[y*terminal_size.x + x] = true;
+    }
+    return all;
+}
+
+void tengi_draw_row(int row, const RGBA8 colors[])
+{
+    update_row_cells(row, colors, NULL);
+}
+
+void tengi_draw_row_cells(int row, const Cell cells[])
+{
+    update_row_cells(row, NULL, cells);
+}
+
+// Hands the back frame over to the present thread with text to draw over it
+void tengi_draw_end(const char text[])
+{
+    PresentFrame* back = &s_frames[s_back];
+    IVec2  size         = cells_size(back->resolution, back->glyphs);
+    size_t cells_length = (size_t)size.x*size.y;
+    memcpy(back->cells, s_cells, cells_length*sizeof back->cells[0]);
+    parse_text(&back->text, text);
+
+    if ( ! s_present_started) {
+        assert(pthread_create(&s_present_thread, NULL, present_loop, NULL) == 0);
+        s_present_started = true;
+    }
+
+    pthread_mutex_lock(&s_present_lock);
+    if (s_frame_ready) // present thread is behind, drop the stale frame
+    {
+        const PresentFrame* dropped = &s_frames[s_ready];
+        if (dropped->resolution.x == back->resolution.x && dropped->resolution.y == back->resolution.y
+            && dropped->glyphs == back->glyphs)
+            for (size_t i = 0; i < cells_length; ++i)
+                back->changed_cells[i] |= dropped->changed_cells[i];
+        else
+            back->redraw_all = true;
+        back->redraw_all |= dropped->redraw_all;
+        s_draw_stats.frames_dropped++;
+    }
+    int ready     = s_ready;
+    s_ready       = s_back;
+    s_back        = ready;
+    s_frame_ready = true;
+    pthread_cond_signal(&s_frame_ready_cond);
+    pthread_mutex_unlock(&s_present_lock);
+}
+
+void tengi_draw_cells(
+    IVec2       resolution,
+    const Cell  cells[],
+    const char  text[],
+    const IRect dirty[],
+    size_t      dirty_length)
+{
+    IVec2 size = cells_size(resolution, s_cell_glyphs);
+    tengi_draw_begin(resolution, dirty, dirty_length);
+    for (int row = 0; row < size.y; ++row)
+        tengi_draw_row_cells(row, &cells[row*size.x]);
+    tengi_draw_end(text);
+}
+
+// TODO text is a temporary hack for rudiemntary menus and debug info. Currently
+// only text and ANSI colors are handled properly, any other escape sequences
+// break! We should do somehting more sophisticated than a null terminated
+// character array.
+void tengi_draw(
+    IVec2       resolution,
+    const RGBA8 colors[],
+    const char  text[],
+    const IRect dirty[],
+    size_t      dirty_length)
+{
+    int height = cell_glyphs[s_cell_glyphs].height;
+    tengi_draw_begin(resolution, dirty, dirty_length);
+    for (int row = 0; colors != NULL && row < resolution.y/height; ++row)
+        tengi_draw_row(row, &colors[height*row*resolution.x]);
+    tengi_draw_end(text);
+}